@@ -5,6 +5,149 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <string.h>
+#include <stdint.h>
+#include "libcsv/csv.h"
+
+/* A parser compatible with the libcsv parser which only unescapes and
+   copies the fields selected with proj_set_columns(), see helper.c */
+struct proj_parser {
+  int pstate;              /* Parser state */
+  int quoted;              /* Is the current field quoted? */
+  size_t spaces;           /* Number of trailing spaces in the current field */
+  int status;              /* libcsv error code of the last error */
+  unsigned char options;   /* CSV_STRICT and CSV_STRICT_FINI are honored */
+  unsigned char delim;     /* The delimiter character */
+  unsigned char quote;     /* The quote character */
+  unsigned char *entry_buf;  /* Buffer holding the current field */
+  size_t entry_pos;        /* Current position in entry_buf */
+  size_t entry_size;       /* Size allocated for entry_buf */
+  size_t field;            /* Index of the current field in the record */
+  int wanted;              /* Is the current field selected? */
+  int at_field_start;      /* Only spaces seen since the last delimiter */
+  const unsigned char *columns;  /* Selected columns, NULL for all */
+  size_t columns_size;     /* Number of elements in columns */
+  size_t row_pos;          /* Offset just past the last record ended by
+                              the last proj_parse() call, 0 if none.  Also
+                              set before cb2 is called for a record. */
+};
+
+/* Items in temporary files are split into this many partitions at each
+   level, by PARTITION_BITS bits of the hash of their key, see helper.c */
+#define PARTITION_BITS 4
+#define PARTITIONS (1 << PARTITION_BITS)
+
+/* Once this many runs went through the same number of merges they are
+   merged into one, see run_list_add() */
+#define RUN_FAN_IN 32
+
+/* A growable output buffer, see helper.c */
+struct outbuf {
+  char *data;
+  size_t size;             /* Bytes used in data */
+  size_t alloc;            /* Bytes allocated for data */
+};
+
+/* A temporary file of sorted or partitioned output, see helper.c */
+struct run {
+  FILE *fp;
+  int level;               /* The number of merges the run went through */
+};
+
+/* The runs not merged yet, oldest first */
+struct run_list {
+  struct run *runs;
+  size_t count;            /* The number of runs */
+  size_t alloc;            /* Elements allocated for runs */
+  /* Merges n runs into out and closes them */
+  void (*merge)(struct run *in, size_t n, FILE *out);
+};
+
+/* A piece of input ending on a record boundary, see parallel_chunks() */
+struct chunk {
+  char *data;              /* The input bytes */
+  size_t size;             /* The number of bytes in data */
+  size_t alloc;            /* Bytes allocated for data */
+  int last;                /* Set for the last chunk of the input */
+  int status;              /* Set by the process function, 0 on success */
+  struct outbuf out;       /* Output produced for this chunk */
+  int state;               /* Used by parallel_chunks() */
+};
+
+/* The fields of a record stored back to back in one buffer, see helper.c */
+struct record {
+  char *data;              /* The field data */
+  size_t data_size;        /* Bytes used in data */
+  size_t data_alloc;       /* Bytes allocated for data */
+  size_t *offsets;         /* Field i is offsets[i] up to offsets[i+1] */
+  size_t count;            /* The number of fields */
+  size_t offsets_alloc;    /* Elements allocated for offsets */
+  unsigned long allocs;    /* Number of buffer (re)allocations */
+  unsigned long records;   /* Number of records reset */
+};
+
+/* A hash table mapping names to lists of values, see helper.c */
+struct name_entry {
+  char *name;              /* The name, NULL for an empty slot */
+  size_t len;              /* The length of name */
+  uint64_t hash;           /* hash_bytes() of name */
+  size_t *values;          /* The values added for name */
+  size_t count;            /* The number of values */
+};
+
+struct name_table {
+  struct name_entry *slots;  /* Open addressed slots */
+  size_t size;             /* The number of slots, a power of 2 */
+  size_t count;            /* The number of names */
+};
+
+/* Columnar files as written by csvcut --columnar, see helper.c */
+#define COLUMNAR_MAGIC "\211CSVCOL\n"
+#define COLUMNAR_MAGIC_SIZE 8
+#define COLUMNAR_VERSION 1
+#define COLUMNAR_ABSENT UINT64_MAX  /* Length of a field missing from a row */
+
+struct columnar_reader {
+  FILE *fp;                /* The file being read */
+  size_t columns;          /* The number of columns */
+  size_t group_size;       /* Rows per row group, the last may have fewer */
+  struct record names;     /* The column names */
+  size_t rows;             /* The number of rows in the current row group */
+  struct outbuf *data;     /* Per column offsets, lengths and heap of the
+                              current row group as stored in the file */
+};
+
+/* Header records seen before and the field positions resolved from them */
+struct header_cache_entry {
+  uint64_t fingerprint;    /* hash of the header fields */
+  struct record header;    /* Copy of the header record */
+  size_t *positions;       /* The positions resolved from header */
+};
+
+struct header_cache {
+  struct header_cache_entry *entries;
+  size_t count;            /* The number of entries */
+  size_t width;            /* The number of positions per entry */
+};
+
+/* One range of a field list like "1,name,3-5", see helper.c */
+struct field_range {
+  char *start_name;        /* The name of the first field, NULL for a number */
+  char *stop_name;         /* The name of the last field, NULL for a number */
+  size_t start_value;      /* The number of the first field, 0 until resolved */
+  size_t stop_value;       /* The number of the last field, 0 until resolved */
+};
+
+/* The ranges of a field list and the tables resolving their names */
+struct field_specs {
+  struct field_range *specs;
+  size_t count;            /* The number of specs */
+  int unresolved;          /* The number of names not resolved yet */
+  int indexed;             /* Set once names and headers are set up */
+  struct name_table names; /* 2*index for a start_name, 2*index+1 for a
+                              stop_name */
+  struct header_cache headers;  /* Positions resolved from each header */
+  size_t *positions;       /* Scratch space for header cache lookups */
+};
 
 void * xmalloc(size_t size);
 void * xrealloc(void *p, size_t size);
@@ -12,6 +155,86 @@ void err(char *msg);
 char *Strdup(char *s);
 char *Strndup(char *s, size_t len);
 int Is_numeric(char *s);
+int Parse_size(char *s, size_t *size);
 void Strupper(char *s);
+size_t memchr4(const void *s, size_t len, int a, int b, int c, int d);
+size_t latin1_to_utf8(const void *s, size_t len, struct outbuf *out);
+size_t utf16_to_utf8(const void *s, size_t len, int big_endian, int eof, struct outbuf *out);
+uint64_t hash_bytes(const void *s, size_t len, uint64_t seed);
+uint64_t hash_parts(const char *const *parts, const size_t *lens, size_t n, uint64_t seed);
+
+void record_init(struct record *r);
+void record_free(struct record *r);
+void record_reset(struct record *r);
+void record_add(struct record *r, const void *s, size_t len);
+char *record_field(struct record *r, size_t i);
+size_t record_field_size(struct record *r, size_t i);
+
+void outbuf_init(struct outbuf *b);
+void outbuf_free(struct outbuf *b);
+void outbuf_reserve(struct outbuf *b, size_t len);
+void outbuf_putc(struct outbuf *b, int c);
+void outbuf_write(struct outbuf *b, const void *s, size_t len);
+void outbuf_csv(struct outbuf *b, const void *s, size_t len, unsigned char quote);
+int outbuf_flush(struct outbuf *b, FILE *fp);
+void outbuf_put64(struct outbuf *b, uint64_t v);
+void outbuf_pad64(struct outbuf *b);
+void outbuf_fields(struct outbuf *b, struct record *r, unsigned char delim, unsigned char quote);
+void outbuf_key_field(struct outbuf *b, struct record *r, size_t idx);
+
+void item_write(FILE *fp, const uint64_t *head, size_t n, const void *data);
+int item_read(FILE *fp, uint64_t *head, size_t n, struct outbuf *data);
+void item_merge(FILE **in, size_t count, size_t n, size_t order, FILE *out,
+                void (*print)(const uint64_t *head, const char *data, size_t len));
+void partitions_open(FILE **parts);
+size_t partition_index(uint64_t hash, int level);
+int partition_needed(size_t memory, size_t limit, size_t keys, int level);
+
+void run_list_init(struct run_list *l, void (*merge)(struct run *in, size_t n, FILE *out));
+void run_list_free(struct run_list *l);
+FILE *run_file(void);
+void run_list_add(struct run_list *l, FILE *fp);
+
+int columnar_open(struct columnar_reader *r, FILE *fp, int magic_read);
+int columnar_read_group(struct columnar_reader *r);
+char *columnar_field(struct columnar_reader *r, size_t column, size_t row, size_t *len);
+void columnar_close(struct columnar_reader *r);
+
+#ifndef WITHOUT_THREADS
+int parallel_chunks(FILE *fp, int threads, unsigned char delim, unsigned char quote,
+                    void (*process)(struct chunk *, void *),
+                    int (*finish)(struct chunk *, void *),
+                    void *arg, int *serial);
+#endif
+
+void name_table_init(struct name_table *t);
+void name_table_free(struct name_table *t);
+void name_table_add(struct name_table *t, const char *name, size_t len, size_t value);
+size_t *name_table_find(struct name_table *t, const char *name, size_t len, size_t *count);
+
+void header_cache_init(struct header_cache *c, size_t width);
+void header_cache_free(struct header_cache *c);
+int header_cache_find(struct header_cache *c, struct record *header, size_t *positions);
+void header_cache_add(struct header_cache *c, struct record *header, const size_t *positions);
+
+void field_specs_init(struct field_specs *f);
+void field_specs_free(struct field_specs *f);
+void field_specs_parse(struct field_specs *f, char *list, int trim);
+void field_specs_resolve(struct field_specs *f, struct record *header);
+void field_specs_unresolve(struct field_specs *f);
+char *field_specs_unresolved_name(struct field_specs *f);
+size_t *field_specs_fields(struct field_specs *f, size_t *count);
+
+int proj_init(struct proj_parser *p, unsigned char options);
+void proj_free(struct proj_parser *p);
+void proj_set_delim(struct proj_parser *p, unsigned char c);
+void proj_set_quote(struct proj_parser *p, unsigned char c);
+void proj_set_columns(struct proj_parser *p, const unsigned char *columns, size_t size);
+int proj_error(struct proj_parser *p);
+size_t proj_parse(struct proj_parser *p, const void *s, size_t len,
+                  void (*cb1)(void *, size_t, void *),
+                  void (*cb2)(int, void *), void *data);
+int proj_fini(struct proj_parser *p, void (*cb1)(void *, size_t, void *),
+              void (*cb2)(int, void *), void *data);
 
 #endif
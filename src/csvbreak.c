@@ -19,6 +19,7 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -29,22 +30,80 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "version.h"
 #include "helper.h"
 
+#ifndef WITHOUT_ZLIB
+#  include <zlib.h>
+#endif
+
+#ifdef WITH_ZSTD
+#  include <zstd.h>
+#endif
+
+#ifndef WITHOUT_THREADS
+#  include <pthread.h>
+#endif
+
 #define PROGRAM_NAME "csvbreak"
 #define AUTHORS "Robert Gamble"
 
-typedef struct entry {
-  size_t size;       /* The size of the current entry */
-  size_t alloc_size; /* The size allocated for data */
-  char *data;        /* The field data */
-} entry;
+/* A partition's buffered output is written once it holds this much */
+#define PARTITION_FLUSH_SIZE 65536
+
+/* Compressed output is written this many bytes at a time */
+#define COMPRESS_BUFFER_SIZE 65536
+
+/* Spilled output is copied this many bytes at a time */
+#define SPILL_COPY_SIZE (1024 * 1024)
+
+/* The compressor of an open file with --compress, it is kept apart from
+   file_array so a compression thread can use it while file_array grows */
+typedef struct compressor {
+  void *stream;             /* A z_stream or a ZSTD_CCtx */
+  FILE *fp;                 /* Where the compressed output goes */
+  struct outbuf job;        /* Output queued for a compression thread */
+  int busy;                 /* Set while job is queued or being compressed */
+  int error;                /* Set if compressing or writing job failed */
+  struct compressor *next;  /* The next compressor in the job queue */
+} compressor;
 
 typedef struct file {
   char *name;
+  size_t name_len;          /* The length of name */
+  uint64_t hash;            /* hash_bytes() of name */
   char *filename;
   FILE *fp;
   long unsigned count;
+  size_t lru_prev;          /* Index plus one of the next more recently */
+  size_t lru_next;          /* and less recently used open file, 0 if none */
+  struct outbuf out;        /* Records waiting to be written */
+  size_t spill_first;       /* Offsets plus one of the first and last */
+  size_t spill_last;        /* block of output in spill_buf, 0 if none */
+  int created;              /* Set once the file has been created */
+  size_t heap_pos;          /* Position in count_heap with --top */
+  long unsigned error;      /* The most count may be too high by, with --top */
+  compressor *z;            /* Compressor state while open with --compress */
 } file;
 
+/* The records of one break value in a chunk, with --threads */
+typedef struct group {
+  size_t records;           /* The number of records */
+  struct outbuf out;        /* The records printed as CSV */
+} group;
+
+/* The state of a worker parsing one chunk with --threads */
+typedef struct break_state {
+  struct proj_parser parser;  /* The parser calling chunk_cb1 and chunk_cb2 */
+  struct record entries;      /* The fields of the current record */
+  struct record keys;         /* The break value of each group */
+  struct outbuf key;          /* The break value of the current record */
+  struct name_table groups;   /* The group index of each break value */
+  group *group_array;         /* The groups in the order first seen */
+  size_t group_alloc;         /* The number of elements allocated */
+  struct chunk *chunk;        /* The chunk being parsed */
+} break_state;
+
+/* Chunk status when a record was seen before the break field was found */
+#define CHUNK_NO_FIELD -1
+
 static struct option const longopts[] = 
 {
   {"print-counts", no_argument, NULL, 'c'},
@@ -58,6 +117,20 @@ static struct option const longopts[] =
   {"prefix", required_argument, NULL, 'P'},
   {"version", no_argument, NULL, CHAR_MAX + 1},
   {"help", no_argument, NULL, CHAR_MAX + 2},
+  {"max-open-files", required_argument, NULL, CHAR_MAX + 3},
+  {"stats", no_argument, NULL, CHAR_MAX + 4},
+  {"memory", required_argument, NULL, CHAR_MAX + 5},
+  {"buckets", required_argument, NULL, CHAR_MAX + 6},
+  {"max-rows", required_argument, NULL, CHAR_MAX + 7},
+  {"max-bytes", required_argument, NULL, CHAR_MAX + 8},
+  {"top", required_argument, NULL, CHAR_MAX + 9},
+  {"sort", required_argument, NULL, CHAR_MAX + 10},
+  {"threads", required_argument, NULL, CHAR_MAX + 11},
+  {"compress", required_argument, NULL, CHAR_MAX + 12},
+  {"compress-threads", required_argument, NULL, CHAR_MAX + 13},
+  {"joiner", required_argument, NULL, CHAR_MAX + 14},
+  {"sorted", optional_argument, NULL, CHAR_MAX + 15},
+  {"spill", no_argument, NULL, CHAR_MAX + 16},
   {NULL, 0, NULL, 0}
 };
 
@@ -68,14 +141,39 @@ int just_print_counts;
 /* The array of files that have been opened */
 file *file_array;
 
-/* The current entry array */
-entry *entry_array;
+/* The fields of the current record */
+struct record entries;
 
 /* The current size of the file array */
 size_t file_array_size;
 
-/* The current size of the entry array */
-size_t entry_array_size;
+/* The number of elements allocated for file_array */
+size_t file_array_alloc;
+
+/* Open addressed hash table of file_array indexes plus one, 0 marks an
+   empty slot */
+size_t *file_table;
+
+/* The number of slots in file_table, a power of 2 */
+size_t file_table_size;
+
+/* The most and least recently used open files, index plus one */
+size_t lru_head;
+size_t lru_tail;
+
+/* The number of open output files */
+size_t open_files;
+
+/* The most output files to keep open, 0 for as many as possible */
+size_t max_open_files;
+
+/* Print the counters below at exit if set */
+int show_stats;
+
+/* Output files created, closed to make room and opened again */
+long unsigned files_opened;
+long unsigned files_closed;
+long unsigned files_reopened;
 
 /* The prefix to use for created files */
 char *filename_prefix = "";
@@ -86,18 +184,62 @@ char *filename_suffix = ".csv";
 /* The name this program was called with */
 char *program_name;
 
-/* Do we need to resolve a field name? */
-int need_name_resolution;
-
 /* The current input file*/
 FILE *infile;
 
-/* The numeric index of the field to break on */
+/* The highest numbered key field, the break value is known once the
+   parser gets to it */
 unsigned long break_field;
 
 /* The break field argument */
 char *break_field_name;
 
+/* The field specifications */
+struct field_specs specs;
+
+/* The numbers of the fields making up the break value, in order */
+size_t *key_fields;
+
+/* The number of key fields */
+size_t key_field_count;
+
+/* Flags for the fields up to break_field, set for the key fields */
+unsigned char *key_field_flags;
+
+/* The key fields and the joiners between them for select_key() */
+const char **key_parts;
+size_t *key_lens;
+
+/* With --sorted only the current partition is kept, what to do when a
+   value is seen again after its file was finished */
+enum { SORTED_OFF, SORTED_ERROR, SORTED_APPEND } sorted_input;
+
+/* The names of the partitions finished with --sorted */
+struct name_table finished_files;
+
+/* If set, buffered output is spilled to runs and merged at the end */
+int spill;
+
+/* The runs spilled and not merged yet.  A run holds the buffered output
+   of every partition at one point, each partition with output has a block
+   made of its index and size followed by the output, in partition order. */
+struct run_list runs;
+
+/* The number of runs spilled, for --stats */
+long unsigned runs_spilled;
+
+/* With --spill the buffered output of all partitions, see part_output() */
+struct outbuf spill_buf;
+
+/* The offset in spill_buf of the last block */
+size_t spill_block;
+
+/* Put between the key fields in the break value and file name */
+char *key_joiner = "_";
+
+/* The length of key_joiner */
+size_t key_joiner_len = 1;
+
 /* The delimiter character */
 char delimiter = CSV_COMMA;
 
@@ -122,17 +264,93 @@ long unsigned current_record = 1;
 /* True while the current record is the first non-empty record */
 int first_record = 1;
 
-/* The name of the file to print the current record to */
-char *cur_filename;
+/* The partition to print the current record to */
+file *cur_part;
+
+/* The most memory to use for buffered output of all partitions */
+size_t memory_limit = 64 * 1024 * 1024;
+
+/* The memory allocated for buffered output, with --spill the size of
+   spill_buf */
+size_t buffered_memory;
+
+/* If set, the number of files to hash the break field values into */
+size_t buckets;
 
-/* The current output file handle */
-FILE *cur_file;
+/* If set, the most records to put in each chunk, see --max-rows */
+size_t max_rows;
 
-/* The header array */
-entry *header;
+/* If set, the most bytes to put in each chunk, see --max-bytes */
+size_t max_bytes;
 
-/* The current size of the header array */
-size_t header_size;
+/* The input being parsed and the offset of the current record in it,
+   scan_buf is NULL while the parser is finished */
+char *scan_buf;
+size_t record_start;
+
+/* The bytes of the current record as they were read */
+struct outbuf raw_record;
+
+/* The bytes of the header record as they were read */
+struct outbuf raw_header;
+
+/* The header record as printed to each file, without the key fields
+   with -r */
+struct outbuf header_bytes;
+
+/* If set, only count the top_k most frequent values approximately */
+size_t top_k;
+
+/* Min-heap on count of the file_array indexes with --top */
+size_t *count_heap;
+
+/* How print_counts() orders the values */
+enum { SORT_NONE, SORT_COUNT, SORT_VALUE } sort_order;
+
+/* Set if the last record copied ended with a CR */
+int pending_lf;
+
+/* The number of chunks started and the records and bytes in the last */
+long unsigned chunk_count;
+size_t chunk_rows;
+size_t chunk_bytes;
+
+/* The number of threads to use */
+int threads = 1;
+
+/* How created files are compressed */
+enum { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD } compress_method;
+
+/* Set if a suffix was given with -S */
+int suffix_given;
+
+/* The number of threads compressing output, 0 to compress as it is
+   written */
+int compress_threads;
+
+#ifndef WITHOUT_THREADS
+/* Protects the job queue and the busy and error flags of compressors */
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Signalled when a job is queued or finished */
+pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+/* The compressors with a job waiting for a thread, oldest first */
+compressor *job_head;
+compressor *job_tail;
+
+/* The bytes waiting in the job queue */
+size_t job_memory;
+
+/* Set to stop the compression threads once the queue is empty */
+int jobs_done;
+
+/* The compression threads, NULL when not running */
+pthread_t *compress_workers;
+#endif
+
+/* The fields of the header record */
+struct record header;
 
 /* Option to print header */
 int write_header;
@@ -143,8 +361,33 @@ int remove_break_field;
 /* cleanup() will remove files at exit if set */
 int call_remove_files = 1;
 
+/* Flags for the fields the parser needs to pass to cb1 */
+unsigned char *column_array;
+
 int close_one_file(void);
-void select_file(char *field_value, size_t len);
+void lru_unlink(size_t i);
+void lru_push(size_t i);
+void open_file(file *ptr, const char *mode);
+void flush_file(file *ptr);
+void flush_files(void);
+struct outbuf *part_output(void);
+void buffer_written(size_t alloc);
+void grow_file_table(void);
+size_t *file_slot(const char **parts, const size_t *lens, size_t n, uint64_t hash);
+void select_key(void);
+void select_file(const char **parts, size_t *lens, size_t n);
+void select_bucket(const char **parts, const size_t *lens, size_t n);
+void select_sorted(const char **parts, const size_t *lens, size_t n, size_t len);
+void add_file(const char *name, size_t len, uint64_t hash);
+void add_buckets(void);
+void remove_slot(size_t *slot);
+void heap_down(size_t pos);
+void count_top(file *ptr, const char *value, size_t len, uint64_t hash);
+int compare_count(const void *a, const void *b);
+int compare_value(const void *a, const void *b);
+void print_counts(void);
+void print_count(file *ptr);
+void put_record(struct outbuf *b, struct record *r, size_t count);
 void print_record(void);
 void free_files(void);
 void close_files(void);
@@ -153,39 +396,75 @@ void usage (int status);
 char * make_file_name(char *data);
 void cb1 (void *data, size_t len, void *vp);
 void cb2 (int c, void *vp);
-void make_header(void);
+void make_header(const char *raw, size_t len);
+void write_part(const char *s, size_t len);
+void spill_run(void);
+void write_spilled(void);
+void next_block(FILE *fp, uint64_t *block);
+void merge_runs(struct run *in, size_t n, FILE *out);
+void new_chunk(void);
+void chunk_record(struct proj_parser *p);
+void close_file(size_t i);
+compressor *compress_open(FILE *fp);
+int compress_write(compressor *z, const char *data, size_t len, int finish);
+void compress_wait(compressor *z);
+void compress_close(compressor *z);
+void compress_submit(compressor *z, struct outbuf *b);
+void start_compress_threads(void);
+void stop_compress_threads(void);
 void print_header(void);
+void select_columns(struct proj_parser *p);
+void make_key_fields(void);
+void chunk_cb1(void *data, size_t len, void *vp);
+void chunk_cb2(int c, void *vp);
+void break_chunk(struct chunk *c, void *arg);
+int finish_chunk(struct chunk *c, void *arg);
+void break_file(void);
 void cleanup(void);
 
 
 void
 cleanup(void)
 {
-  /* Free memory for entry_array, header,
+  /* Free memory for entries, header,
      and file_array and close open files */
 
   /* Only to be called once by atexit! */
   size_t i;
 
+  /* The compression threads may still be writing to the files */
+  stop_compress_threads();
+
   /* Remove files if unsuccessful termination */
   if (call_remove_files)
     remove_files();
 
-  for (i = 0; entry_array && i < entry_array_size; i++)
-    free(entry_array[i].data);
-  free(entry_array);
-
-  for (i = 0; header && i < header_size; i++)
-    free(header[i].data);
-  free(header);
+  record_free(&entries);
+  record_free(&header);
+  outbuf_free(&raw_record);
+  outbuf_free(&raw_header);
+  outbuf_free(&header_bytes);
+  outbuf_free(&spill_buf);
 
   for (i = 0; file_array && i < file_array_size; i++) {
     free(file_array[i].name);
     free(file_array[i].filename);
+    outbuf_free(&file_array[i].out);
     if (file_array[i].fp)
       fclose(file_array[i].fp);
   }
   free(file_array);
+  free(file_table);
+  free(count_heap);
+  free(column_array);
+
+  field_specs_free(&specs);
+  free(key_fields);
+  free(key_field_flags);
+  free(key_parts);
+  free(key_lens);
+  name_table_free(&finished_files);
+  run_list_free(&runs);
 }
 
 void
@@ -195,18 +474,20 @@ usage (int status)
     fprintf (stderr, "Try `%s --help for more information.\n", program_name);
   else {
     printf("\
-Usage: %s -f FIELD [OPTIONS]... [FILE]\n\
+Usage: %s -f FIELD_LIST [OPTIONS]... [FILE]\n\
+  or:  %s --max-rows=N|--max-bytes=SIZE [OPTIONS]... [FILE]\n\
 Break CSV records into multiple files based on the value of the specified field\n\
 \n\
   -c, --print-counts           don't break file, just print counts by value\n\
   -d, --delimiter=DELIM_CHAR   use DELIM_CHAR instead of comma as delimiter\n\
-  -f, --field=FIELD            field name or number to break on\n\
+  -f, --field=FIELD_LIST       the field names or numbers to break on, the\n\
+                               break value is made of all of them\n\
   -h, --header                 print the header record to each file created\n\
-", program_name);
+", program_name, program_name);
     printf("\
   -q, --quote=QUOTE_CHAR       use QUOTE_CHAR instead of double quote as quote\n\
                                character\n\
-  -r, --remove-break-field     do not print the break field to created files\n\
+  -r, --remove-break-field     do not print the break fields to created files\n\
   -s, --strict                 enforce strict mode, mal-formed CSV files will\n\
                                cause an error\n\
   -S, --suffix                 the suffix to use for the created files\n\
@@ -214,6 +495,30 @@ Break CSV records into multiple files based on the value of the specified field\
 ");
     printf("\
   -P, --prefix                 the prefix to use for the created files\n\
+      --max-open-files=N       keep at most N created files open at a time\n\
+      --memory=SIZE            buffer at most SIZE bytes of output in memory\n\
+      --spill                  spill buffered output to temporary files and\n\
+                               write each created file once at the end\n\
+      --joiner=STRING          put STRING between the values of the break\n\
+                               fields in file names, the default is _\n\
+      --top=K                  like -c, only count the K most frequent values\n\
+                               using a fixed amount of memory\n\
+      --sort=count|value       print the counts by decreasing count or by value\n\
+      --buckets=N              hash the values of the break field into N\n\
+                               files named 0 to N-1\n\
+      --max-rows=N             instead of breaking on a field, copy at most N\n\
+                               records to each of the files 0, 1, 2, ...\n\
+      --max-bytes=SIZE         like --max-rows, with at most SIZE bytes per file\n\
+");
+    printf("\
+      --stats                  print the number of files opened, closed and\n\
+                               reopened to standard error\n\
+      --threads=N              use N threads to parse the input\n\
+      --compress=gzip|zstd     compress the created files\n\
+      --compress-threads=N     compress using N threads besides the main one\n\
+      --sorted[=error|append]  the input is grouped by the break value, keep\n\
+                               one file open and fail or append when a value\n\
+                               is seen again\n\
       --version                display version information and exit\n\
       --help                   display this help and exit\n\
 ");
@@ -222,176 +527,1154 @@ Break CSV records into multiple files based on the value of the specified field\
 }
 
 void
-make_header(void)
+make_header(const char *raw, size_t len)
 {
+  /* Keep the header record, raw is the record as read when splitting
+     into chunks */
   size_t i;
-  header = xmalloc(entry_array_size * sizeof(struct entry));
-  for (i = 0; i < entry_array_size; i++) {
-    header[i].size = entry_array[i].size;
-    header[i].data = xmalloc(entry_array[i].size);
-    memcpy(header[i].data, entry_array[i].data, entry_array[i].size);
-    header_size++;
+  for (i = 0; i < entries.count; i++)
+    record_add(&header, record_field(&entries, i), record_field_size(&entries, i));
+  if (len)
+    outbuf_write(&raw_header, raw, len);
+}
+
+void
+select_columns(struct proj_parser *p)
+{
+  /* Only the key fields are needed when just printing counts, tell the
+     parser once the fields are known and the header has been seen.  No
+     fields are needed when splitting into chunks. */
+  static unsigned char no_columns;
+
+  if (max_rows || max_bytes) {
+    proj_set_columns(p, &no_columns, 0);
+    return;
   }
+
+  if (!just_print_counts || specs.unresolved || break_field == 0
+      || (first_record && write_header)
+      || column_array)
+    return;
+
+  column_array = xmalloc(break_field);
+  memcpy(column_array, key_field_flags, break_field);
+  proj_set_columns(p, column_array, break_field);
+}
+
+void
+lru_unlink(size_t i)
+{
+  /* Remove file_array[i] from the list of open files */
+  file *f = &file_array[i];
+
+  if (f->lru_prev)
+    file_array[f->lru_prev - 1].lru_next = f->lru_next;
+  else
+    lru_head = f->lru_next;
+  if (f->lru_next)
+    file_array[f->lru_next - 1].lru_prev = f->lru_prev;
+  else
+    lru_tail = f->lru_prev;
+  f->lru_prev = f->lru_next = 0;
+}
+
+void
+lru_push(size_t i)
+{
+  /* Make file_array[i] the most recently used open file */
+  file *f = &file_array[i];
+
+  f->lru_prev = 0;
+  f->lru_next = lru_head;
+  if (lru_head)
+    file_array[lru_head - 1].lru_prev = i + 1;
+  else
+    lru_tail = i + 1;
+  lru_head = i + 1;
+}
+
+void
+close_file(size_t i)
+{
+  /* Close file_array[i] if it is open */
+  if (!file_array[i].fp)
+    return;
+  lru_unlink(i);
+  if (file_array[i].z) {
+    compress_close(file_array[i].z);
+    file_array[i].z = NULL;
+  }
+  fclose(file_array[i].fp);
+  file_array[i].fp = NULL;
+  open_files--;
 }
 
 int
 close_one_file(void)
 {
-  size_t i;
+  /* Close the least recently used open file */
+  if (!lru_tail)
+    /* No files to close */
+    return -1;
+
+  close_file(lru_tail - 1);
+  files_closed++;
+  return 0;
+}
 
-  for (i = 0; i < file_array_size; i++) {
-    if (file_array[i].fp) {
-      fclose(file_array[i].fp);
-      file_array[i].fp = NULL;
-      return 0;
-    }
+void
+open_file(file *ptr, const char *mode)
+{
+  /* Open the file for ptr, closing the least recently used file first if
+     the budget is used up or the open fails for lack of descriptors */
+  if (max_open_files && open_files >= max_open_files)
+    close_one_file();
+
+  ptr->fp = fopen(ptr->filename, mode);
+  while (!ptr->fp && (errno == EMFILE || errno == ENFILE) && close_one_file() == 0)
+    ptr->fp = fopen(ptr->filename, mode);
+  if (!ptr->fp)
+    err("Failed to open file");
+
+  /* Output is buffered per partition, each flush is a single write */
+  setvbuf(ptr->fp, NULL, _IONBF, 0);
+
+  /* Every time a file is opened a new gzip member or zstd frame starts,
+     the concatenation decompresses to the whole output */
+  if (compress_method != COMPRESS_NONE)
+    ptr->z = compress_open(ptr->fp);
+
+  lru_push(ptr - file_array);
+  open_files++;
+}
+
+compressor *
+compress_open(FILE *fp)
+{
+  /* Start compressing to fp */
+  compressor *z = xmalloc(sizeof *z);
+
+  z->fp = fp;
+  z->busy = z->error = 0;
+  z->next = NULL;
+  outbuf_init(&z->job);
+
+#ifndef WITHOUT_ZLIB
+  if (compress_method == COMPRESS_GZIP) {
+    z_stream *zs = xmalloc(sizeof *zs);
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+    /* 16 added to the window bits selects the gzip format */
+    if (deflateInit2(zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      err("Failed to initialize compression");
+    z->stream = zs;
+  }
+#endif
+#ifdef WITH_ZSTD
+  if (compress_method == COMPRESS_ZSTD)
+    if ((z->stream = ZSTD_createCCtx()) == NULL)
+      err("Failed to initialize compression");
+#endif
+
+  return z;
+}
+
+int
+compress_write(compressor *z, const char *data, size_t len, int finish)
+{
+  /* Compress len bytes from data to the file, finish ends the gzip member
+     or zstd frame.  Called from the compression threads as well, returns
+     0 on success. */
+#if !defined(WITHOUT_ZLIB) || defined(WITH_ZSTD)
+  unsigned char buf[COMPRESS_BUFFER_SIZE];
+#endif
+
+#ifndef WITHOUT_ZLIB
+  if (compress_method == COMPRESS_GZIP) {
+    z_stream *zs = z->stream;
+    size_t out;
+    uInt n;
+    int rv;
+
+    do {
+      /* avail_in is an unsigned int */
+      n = len > UINT_MAX ? UINT_MAX : (uInt)len;
+      zs->next_in = (Bytef *)data;
+      zs->avail_in = n;
+      data += n;
+      len -= n;
+      do {
+        zs->next_out = buf;
+        zs->avail_out = sizeof buf;
+        rv = deflate(zs, finish && len == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (rv == Z_STREAM_ERROR)
+          return -1;
+        out = sizeof buf - zs->avail_out;
+        if (out && fwrite(buf, 1, out, z->fp) != out)
+          return -1;
+      } while (zs->avail_out == 0 || (finish && len == 0 && rv != Z_STREAM_END));
+    } while (len);
+    return 0;
   }
+#endif
+#ifdef WITH_ZSTD
+  if (compress_method == COMPRESS_ZSTD) {
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t rv;
+
+    in.src = data;
+    in.size = len;
+    in.pos = 0;
+    do {
+      out.dst = buf;
+      out.size = sizeof buf;
+      out.pos = 0;
+      rv = ZSTD_compressStream2(z->stream, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(rv))
+        return -1;
+      if (out.pos && fwrite(buf, 1, out.pos, z->fp) != out.pos)
+        return -1;
+    } while (finish ? rv != 0 : in.pos < in.size);
+    return 0;
+  }
+#endif
 
-  /* No files to close */
   return -1;
 }
 
 void
-select_file(char *field_value, size_t len)
+compress_wait(compressor *z)
 {
-  /* Find the file handle if open, otherwise open the file
-     Set cur_file to the file handle */
-  file *ptr;
-  char *str_value;
-  size_t i = 0;
+  /* Wait for a compression thread to finish the job of z */
+#ifndef WITHOUT_THREADS
+  int error;
 
-  str_value = Strndup(field_value, len);
+  if (!compress_threads)
+    return;
+  pthread_mutex_lock(&job_lock);
+  while (z->busy)
+    pthread_cond_wait(&job_cond, &job_lock);
+  error = z->error;
+  pthread_mutex_unlock(&job_lock);
+  if (error)
+    err("Failed to write file");
+#endif
+}
 
-  while (i < file_array_size) {
-    if (!strcmp(file_array[i].name, str_value)) {
-      /* Found a match */
-      free(str_value);
-      file_array[i].count++;
+void
+compress_close(compressor *z)
+{
+  /* End the compressed stream and free the compressor */
+  compress_wait(z);
+  if (compress_write(z, NULL, 0, 1) != 0)
+    err("Failed to write file");
+
+#ifndef WITHOUT_ZLIB
+  if (compress_method == COMPRESS_GZIP) {
+    deflateEnd(z->stream);
+    free(z->stream);
+  }
+#endif
+#ifdef WITH_ZSTD
+  if (compress_method == COMPRESS_ZSTD)
+    ZSTD_freeCCtx(z->stream);
+#endif
+
+  outbuf_free(&z->job);
+  free(z);
+}
 
-      if (just_print_counts)
-        return;
+void
+compress_submit(compressor *z, struct outbuf *b)
+{
+  /* Hand the output in b over to the compression threads, b is left
+     empty.  Waits while the previous job of z is unfinished or the queue
+     holds more than the memory limit. */
+#ifndef WITHOUT_THREADS
+  pthread_mutex_lock(&job_lock);
+  while (z->busy || (job_memory && job_memory + b->size > memory_limit))
+    pthread_cond_wait(&job_cond, &job_lock);
+  if (z->error) {
+    pthread_mutex_unlock(&job_lock);
+    err("Failed to write file");
+  }
 
-      if (file_array[i].fp) {
-        cur_file = file_array[i].fp;
-        return;
-      }
+  z->job = *b;
+  outbuf_init(b);
+  z->busy = 1;
+  z->next = NULL;
+  if (job_tail)
+    job_tail->next = z;
+  else
+    job_head = z;
+  job_tail = z;
+  job_memory += z->job.size;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+#endif
+}
 
-      file_array[i].fp = fopen(file_array[i].filename, "ab");
-      if (!file_array[i].fp) {
-        /* Can't open file, may be too many open, try closing one first */
-        if (close_one_file() != 0)
-          err("Failed to open file");
-        file_array[i].fp = fopen(file_array[i].filename, "ab");
-        if (!file_array[i].fp)
-          err("Failed to open file");
-      }
-   
-      return;
+#ifndef WITHOUT_THREADS
+void *
+compress_worker(void *vp)
+{
+  /* Compress queued jobs until stop_compress_threads() is called */
+  compressor *z;
+  size_t size;
+  int rv;
+
+  pthread_mutex_lock(&job_lock);
+  for (;;) {
+    while (!job_head && !jobs_done)
+      pthread_cond_wait(&job_cond, &job_lock);
+    if (!job_head)
+      break;
+    z = job_head;
+    if ((job_head = z->next) == NULL)
+      job_tail = NULL;
+    pthread_mutex_unlock(&job_lock);
+
+    /* Nothing else touches z while it is busy */
+    size = z->job.size;
+    rv = compress_write(z, z->job.data, size, 0);
+    outbuf_free(&z->job);
+
+    pthread_mutex_lock(&job_lock);
+    if (rv)
+      z->error = 1;
+    z->busy = 0;
+    job_memory -= size;
+    pthread_cond_broadcast(&job_cond);
+  }
+  pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+#endif
+
+void
+start_compress_threads(void)
+{
+#ifndef WITHOUT_THREADS
+  int i;
+
+  compress_workers = xmalloc(compress_threads * sizeof *compress_workers);
+  for (i = 0; i < compress_threads; i++)
+    if (pthread_create(&compress_workers[i], NULL, compress_worker, NULL) != 0)
+      err("Failed to create thread");
+#endif
+}
+
+void
+stop_compress_threads(void)
+{
+  /* Let the compression threads finish the queue and wait for them */
+#ifndef WITHOUT_THREADS
+  int i;
+
+  if (!compress_workers)
+    return;
+  pthread_mutex_lock(&job_lock);
+  jobs_done = 1;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+  for (i = 0; i < compress_threads; i++)
+    pthread_join(compress_workers[i], NULL);
+  free(compress_workers);
+  compress_workers = NULL;
+#endif
+}
+
+void
+grow_file_table(void)
+{
+  /* Double the size of file_table using the cached hashes */
+  size_t i, j, mask;
+
+  file_table_size = file_table_size ? file_table_size * 2 : 64;
+  mask = file_table_size - 1;
+  free(file_table);
+  file_table = xmalloc(file_table_size * sizeof *file_table);
+  memset(file_table, 0, file_table_size * sizeof *file_table);
+
+  for (i = 0; i < file_array_size; i++) {
+    j = (size_t)file_array[i].hash & mask;
+    while (file_table[j])
+      j = (j + 1) & mask;
+    file_table[j] = i + 1;
+  }
+}
+
+size_t *
+file_slot(const char **parts, const size_t *lens, size_t n, uint64_t hash)
+{
+  /* Return the slot of file_table holding the value made of n parts or
+     the empty slot where it belongs */
+  size_t i = (size_t)hash & (file_table_size - 1);
+  size_t len = 0, pos, j;
+  file *f;
+
+  for (j = 0; j < n; j++)
+    len += lens[j];
+
+  while (file_table[i]) {
+    f = &file_array[file_table[i] - 1];
+    if (f->hash == hash && f->name_len == len) {
+      for (j = 0, pos = 0; j < n && !memcmp(f->name + pos, parts[j], lens[j]); j++)
+        pos += lens[j];
+      if (j == n)
+        break;
+    }
+    i = (i + 1) & (file_table_size - 1);
+  }
+  return &file_table[i];
+}
+
+void
+select_key(void)
+{
+  /* Make the partition of the break value of the current record the
+     current partition, the key fields and the joiners between them are
+     hashed and compared where they are */
+  size_t i, n = 0;
+
+  for (i = 0; i < key_field_count; i++) {
+    if (i) {
+      key_parts[n] = key_joiner;
+      key_lens[n++] = key_joiner_len;
+    }
+    key_parts[n] = record_field(&entries, key_fields[i] - 1);
+    key_lens[n++] = record_field_size(&entries, key_fields[i] - 1);
+  }
+
+  if (buckets)
+    select_bucket(key_parts, key_lens, n);
+  else
+    select_file(key_parts, key_lens, n);
+}
+
+void
+select_file(const char **parts, size_t *lens, size_t n)
+{
+  /* Find the partition for the value made of n parts, adding it if it is
+     new, and make it the current partition */
+  const char *nul;
+  char *name;
+  size_t *slot, len = 0, i;
+  uint64_t hash;
+
+  /* The value is truncated at a null character like the file name */
+  for (i = 0; i < n; i++) {
+    if (lens[i] && (nul = memchr(parts[i], '\0', lens[i])) != NULL) {
+      lens[i] = nul - parts[i];
+      n = i + 1;
     }
-    i++;
+    len += lens[i];
+  }
+
+  if (sorted_input) {
+    select_sorted(parts, lens, n, len);
+    return;
+  }
+
+  /* Keep the table at most half full */
+  if (2 * (file_array_size + 1) > file_table_size)
+    grow_file_table();
+
+  hash = hash_parts(parts, lens, n, 0);
+  slot = file_slot(parts, lens, n, hash);
+
+  if (*slot) {
+    /* Found a match */
+    cur_part = &file_array[*slot - 1];
+    cur_part->count++;
+    if (top_k)
+      heap_down(cur_part->heap_pos);
+    return;
+  }
+
+  name = xmalloc(len + 1);
+  for (i = 0, len = 0; i < n; len += lens[i++])
+    memcpy(name + len, parts[i], lens[i]);
+  name[len] = '\0';
+
+  if (top_k && file_array_size == top_k) {
+    /* Replace the least frequent value */
+    count_top(&file_array[count_heap[0]], name, len, hash);
+    free(name);
+    return;
   }
 
   /* Not found, add */
-  file_array = xrealloc(file_array, (file_array_size+1) * sizeof(struct file));
+  *slot = file_array_size + 1;
+  add_file(name, len, hash);
+  free(name);
+  cur_part->count = 1;
+
+  if (top_k) {
+    /* A new value has the lowest count, move it up the heap */
+    i = file_array_size - 1;
+    while (i && file_array[count_heap[(i-1)/2]].count > cur_part->count) {
+      count_heap[i] = count_heap[(i-1)/2];
+      file_array[count_heap[i]].heap_pos = i;
+      i = (i-1)/2;
+    }
+    count_heap[i] = file_array_size - 1;
+    cur_part->heap_pos = i;
+  }
+}
+
+void
+remove_slot(size_t *slot)
+{
+  /* Empty a slot of file_table, the entries after it are moved back so
+     that every entry can still be reached from its home slot */
+  size_t mask = file_table_size - 1;
+  size_t i = slot - file_table, j = i, home;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!file_table[j])
+      break;
+    home = (size_t)file_array[file_table[j] - 1].hash & mask;
+    /* Move the entry unless its home lies cyclically in (i, j] */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      file_table[i] = file_table[j];
+      i = j;
+    }
+  }
+  file_table[i] = 0;
+}
+
+void
+heap_down(size_t pos)
+{
+  /* Restore the heap after the count at pos was increased */
+  size_t child, n = file_array_size, tmp;
+
+  while ((child = 2 * pos + 1) < n) {
+    if (child + 1 < n && file_array[count_heap[child+1]].count < file_array[count_heap[child]].count)
+      child++;
+    if (file_array[count_heap[pos]].count <= file_array[count_heap[child]].count)
+      break;
+    tmp = count_heap[pos];
+    count_heap[pos] = count_heap[child];
+    count_heap[child] = tmp;
+    file_array[count_heap[pos]].heap_pos = pos;
+    file_array[count_heap[child]].heap_pos = child;
+    pos = child;
+  }
+}
+
+void
+count_top(file *ptr, const char *value, size_t len, uint64_t hash)
+{
+  /* Space-saving: the least frequent value is replaced by the new one,
+     which inherits its count plus one as an overestimate */
+  remove_slot(file_slot((const char **)&ptr->name, &ptr->name_len, 1, ptr->hash));
+
+  free(ptr->name);
+  ptr->name = Strndup((char *)value, len);
+  ptr->name_len = len;
+  ptr->hash = hash;
+  ptr->error = ptr->count;
+  ptr->count++;
+  *file_slot(&value, &len, 1, hash) = ptr - file_array + 1;
+
+  cur_part = ptr;
+  heap_down(ptr->heap_pos);
+}
+
+void
+add_file(const char *name, size_t len, uint64_t hash)
+{
+  /* Add a partition to file_array and make it the current partition */
+  file *ptr;
+
+  if (file_array_size == file_array_alloc) {
+    file_array_alloc = file_array_alloc ? file_array_alloc * 2 : 64;
+    file_array = xrealloc(file_array, file_array_alloc * sizeof(struct file));
+  }
   file_array_size++;
 
   ptr = &file_array[file_array_size - 1];
-  ptr->filename = NULL; 
   ptr->fp = NULL;
-  ptr->name = str_value;
-  ptr->filename = make_file_name(str_value);
-  ptr->count = 1;
+  ptr->name = Strndup((char *)name, len);
+  ptr->name_len = len;
+  ptr->hash = hash;
+  ptr->filename = just_print_counts ? NULL : make_file_name(ptr->name);
+  ptr->count = 0;
+  ptr->error = 0;
+  ptr->lru_prev = ptr->lru_next = 0;
+  outbuf_init(&ptr->out);
+  ptr->spill_first = ptr->spill_last = 0;
+  ptr->created = 0;
+  ptr->z = NULL;
+  cur_part = ptr;
  
   if (just_print_counts) return;
  
-  ptr->fp = fopen(ptr->filename, "wb");
-  if (!ptr->fp) {
-    if (close_one_file() != 0)
-      err("Failed to open file");
-    ptr->fp = fopen(ptr->filename, "ab");
-    if (!ptr->fp)
-      err("Failed to open file");
+  /* Print header for a new file */
+  if (write_header)
+    print_header();
+}
+
+void
+add_buckets(void)
+{
+  /* Add a partition for each bucket */
+  char num[32];
+  size_t i;
+
+  for (i = 0; i < buckets; i++) {
+    sprintf(num, "%lu", (long unsigned)i);
+    add_file(num, strlen(num), 0);
   }
+}
 
-  if (ptr->fp == NULL)
-    err("Failed to open file");
+void
+select_sorted(const char **parts, const size_t *lens, size_t n, size_t len)
+{
+  /* With --sorted the current partition is the only one, its file is
+     finished when the value changes and only its name is remembered */
+  size_t i, pos, count;
+  char *name;
+  int seen;
+
+  if (file_array_size && cur_part->name_len == len) {
+    for (i = 0, pos = 0; i < n && !memcmp(cur_part->name + pos, parts[i], lens[i]); i++)
+      pos += lens[i];
+    if (i == n) {
+      cur_part->count++;
+      return;
+    }
+  }
 
-  cur_file = ptr->fp;
+  name = xmalloc(len + 1);
+  for (i = 0, pos = 0; i < n; pos += lens[i++])
+    memcpy(name + pos, parts[i], lens[i]);
+  name[len] = '\0';
 
-  /* Print header if we opened a new file */
-  if (write_header)
+  if (file_array_size == 0) {
+    add_file(name, len, 0);
+    cur_part->count = 1;
+    free(name);
+    return;
+  }
+
+  flush_file(cur_part);
+  close_file(0);
+  name_table_add(&finished_files, cur_part->name, cur_part->name_len, 0);
+
+  seen = name_table_find(&finished_files, name, len, &count) != NULL;
+  if (seen && sorted_input == SORTED_ERROR) {
+    fprintf(stderr, "The input is not grouped by the break fields, '%s' was seen again\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  free(cur_part->name);
+  free(cur_part->filename);
+  cur_part->name = name;
+  cur_part->name_len = len;
+  cur_part->filename = make_file_name(name);
+  cur_part->count = 1;
+
+  /* A file seen before is appended to without another header */
+  cur_part->created = seen;
+  if (!seen && write_header)
     print_header();
 }
 
 void
-print_record(void)
+select_bucket(const char **parts, const size_t *lens, size_t n)
+{
+  /* Make the bucket the value hashes to the current partition, all the
+     buckets are added when the first value is seen */
+  if (file_array_size == 0)
+    add_buckets();
+
+  cur_part = &file_array[hash_parts(parts, lens, n, 0) % buckets];
+  cur_part->count++;
+}
+
+void
+flush_file(file *ptr)
+{
+  /* Write the buffered output of a partition, the first write creates
+     the file and later ones append to it.  A file is created even if
+     there is nothing to write so that every bucket exists. */
+  if (ptr->out.size == 0 && ptr->created)
+    return;
+
+  if (!ptr->fp) {
+    open_file(ptr, ptr->created ? "ab" : "wb");
+    if (ptr->created)
+      files_reopened++;
+    else
+      files_opened++;
+    ptr->created = 1;
+  } else if (lru_head != (size_t)(ptr - file_array) + 1) {
+    lru_unlink(ptr - file_array);
+    lru_push(ptr - file_array);
+  }
+
+  if (ptr->z && compress_threads) {
+    /* The buffer goes with the job, a new one is allocated */
+    buffered_memory -= ptr->out.alloc;
+    compress_submit(ptr->z, &ptr->out);
+    return;
+  }
+
+  if (ptr->z ? compress_write(ptr->z, ptr->out.data, ptr->out.size, 0) != 0
+      : fwrite(ptr->out.data, 1, ptr->out.size, ptr->fp) != ptr->out.size)
+    err("Failed to write file");
+  ptr->out.size = 0;
+}
+
+void
+flush_files(void)
+{
+  /* Write the output of every partition and release the buffers, each
+     file is opened at most once */
+  size_t i;
+
+  for (i = 0; i < file_array_size; i++) {
+    flush_file(&file_array[i]);
+    outbuf_free(&file_array[i].out);
+  }
+  buffered_memory = 0;
+}
+
+struct outbuf *
+part_output(void)
+{
+  /* Return the buffer to add output for the current partition to.  With
+     --spill all partitions share spill_buf, so a partition with little
+     output doesn't hold a buffer of its own.  spill_buf holds blocks made
+     of the offset plus one of the next block of the same partition, the
+     size and the output, and the last block grows while the current
+     partition stays the same. */
+  size_t head[2] = { 0, 0 };
+  size_t next;
+
+  if (!spill)
+    return &cur_part->out;
+
+  if (cur_part->spill_last && cur_part->spill_last - 1 == spill_block)
+    return &spill_buf;
+
+  next = spill_buf.size + 1;
+  if (cur_part->spill_last)
+    memcpy(spill_buf.data + cur_part->spill_last - 1, &next, sizeof next);
+  else
+    cur_part->spill_first = next;
+  cur_part->spill_last = next;
+  spill_block = spill_buf.size;
+  outbuf_write(&spill_buf, head, sizeof head);
+  return &spill_buf;
+}
+
+void
+buffer_written(size_t alloc)
 {
+  /* Account for output added to the current partition, whose buffer had
+     alloc bytes allocated before, and write out full buffers */
+  size_t size;
+
+  if (spill) {
+    /* spill_buf is kept when spilled, so its size is what counts */
+    size = spill_buf.size - spill_block - 2 * sizeof size;
+    memcpy(spill_buf.data + spill_block + sizeof size, &size, sizeof size);
+    buffered_memory = spill_buf.size;
+    if (buffered_memory > memory_limit)
+      spill_run();
+    return;
+  }
+
+  buffered_memory += cur_part->out.alloc - alloc;
+
+  if (buffered_memory > memory_limit)
+    flush_files();
+  else if (cur_part->out.size >= PARTITION_FLUSH_SIZE)
+    flush_file(cur_part);
+}
+
+void
+spill_run(void)
+{
+  /* Write the buffered output of every partition to a new run and empty
+     spill_buf */
+  FILE *fp = run_file();
+  uint64_t head[2];
+  size_t i, pos, block[2];
+  file *ptr;
+
+  for (i = 0; i < file_array_size; i++) {
+    ptr = &file_array[i];
+    if (!ptr->spill_first)
+      continue;
+    head[0] = i;
+    head[1] = 0;
+    for (pos = ptr->spill_first; pos; pos = block[0]) {
+      memcpy(block, spill_buf.data + pos - 1, sizeof block);
+      head[1] += block[1];
+    }
+    if (fwrite(head, sizeof head, 1, fp) != 1)
+      err("Failed to write temporary file");
+    for (pos = ptr->spill_first; pos; pos = block[0]) {
+      memcpy(block, spill_buf.data + pos - 1, sizeof block);
+      if (fwrite(spill_buf.data + pos - 1 + sizeof block, 1, block[1], fp) != block[1])
+        err("Failed to write temporary file");
+    }
+    ptr->spill_first = ptr->spill_last = 0;
+  }
+  spill_buf.size = 0;
+  buffered_memory = 0;
+  runs_spilled++;
+  run_list_add(&runs, fp);
+}
+
+void
+write_spilled(void)
+{
+  /* Write the output in spill_buf to the partition files when nothing was
+     spilled, each file is created and written in one go and closed again */
+  size_t i, pos, block[2];
+  file *ptr;
+
+  for (i = 0; i < file_array_size; i++) {
+    ptr = &file_array[i];
+    if (!ptr->spill_first)
+      continue;
+    for (pos = ptr->spill_first; pos; pos = block[0]) {
+      memcpy(block, spill_buf.data + pos - 1, sizeof block);
+      outbuf_write(&ptr->out, spill_buf.data + pos - 1 + sizeof block, block[1]);
+      if (ptr->out.size >= PARTITION_FLUSH_SIZE)
+        flush_file(ptr);
+    }
+    flush_file(ptr);
+    close_file(i);
+    outbuf_free(&ptr->out);
+    ptr->spill_first = ptr->spill_last = 0;
+  }
+  outbuf_free(&spill_buf);
+}
+
+void
+next_block(FILE *fp, uint64_t *block)
+{
+  /* Read the head of the next block of a run into block, its partition
+     and size.  The partition is UINT64_MAX at the end of the run. */
+  if (fread(block, sizeof *block, 2, fp) != 2) {
+    if (ferror(fp))
+      err("Failed to read temporary file");
+    block[0] = UINT64_MAX;
+  }
+}
+
+void
+merge_runs(struct run *in, size_t n, FILE *out)
+{
+  /* Merge n runs, the blocks of a partition are taken from the runs in
+     order so its output stays in input order.  If out is set the result
+     is a run with one block per partition, otherwise each partition file
+     is created and written in one go and closed again. */
+  char *buf = out ? xmalloc(SPILL_COPY_SIZE) : NULL;
+  uint64_t (*blocks)[2] = xmalloc(n * sizeof *blocks);
+  uint64_t part, size, head[2];
+  size_t i, len;
+  file *ptr = NULL;
+
+  for (i = 0; i < n; i++) {
+    rewind(in[i].fp);
+    next_block(in[i].fp, blocks[i]);
+  }
+
+  for (;;) {
+    part = UINT64_MAX;
+    size = 0;
+    for (i = 0; i < n; i++)
+      if (blocks[i][0] < part)
+        part = blocks[i][0];
+    if (part == UINT64_MAX)
+      break;
+
+    if (out) {
+      for (i = 0; i < n; i++)
+        if (blocks[i][0] == part)
+          size += blocks[i][1];
+      head[0] = part;
+      head[1] = size;
+      if (fwrite(head, sizeof head, 1, out) != 1)
+        err("Failed to write temporary file");
+    } else {
+      ptr = &file_array[part];
+    }
+
+    for (i = 0; i < n; i++) {
+      if (blocks[i][0] != part)
+        continue;
+      while (blocks[i][1]) {
+        len = blocks[i][1] < SPILL_COPY_SIZE ? blocks[i][1] : SPILL_COPY_SIZE;
+        if (out) {
+          if (fread(buf, 1, len, in[i].fp) != len)
+            err("Failed to read temporary file");
+          if (fwrite(buf, 1, len, out) != len)
+            err("Failed to write temporary file");
+        } else {
+          outbuf_reserve(&ptr->out, len);
+          if (fread(ptr->out.data + ptr->out.size, 1, len, in[i].fp) != len)
+            err("Failed to read temporary file");
+          ptr->out.size += len;
+          flush_file(ptr);
+        }
+        blocks[i][1] -= len;
+      }
+      next_block(in[i].fp, blocks[i]);
+    }
+
+    if (!out) {
+      close_file(part);
+      outbuf_free(&ptr->out);
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    fclose(in[i].fp);
+  if (out && fflush(out) != 0)
+    err("Failed to write temporary file");
+  free(blocks);
+  free(buf);
+}
+
+void
+write_part(const char *s, size_t len)
+{
+  /* Add len bytes from s to the output of the current partition */
+  struct outbuf *b = part_output();
+  size_t alloc = b->alloc;
+
+  outbuf_write(b, s, len);
+  buffer_written(alloc);
+}
+
+void
+new_chunk(void)
+{
+  /* Finish the current chunk and start the next one, chunks are named by
+     number like buckets */
+  char num[32];
+
+  if (cur_part) {
+    flush_file(cur_part);
+    close_file(cur_part - file_array);
+    buffered_memory -= cur_part->out.alloc;
+    outbuf_free(&cur_part->out);
+  }
+
+  sprintf(num, "%lu", chunk_count++);
+  add_file(num, strlen(num), 0);
+  chunk_rows = 0;
+  chunk_bytes = write_header ? raw_header.size : 0;
+}
+
+void
+chunk_record(struct proj_parser *p)
+{
+  /* Copy the record just parsed to the current chunk exactly as it was
+     read, starting a new chunk first if the record doesn't fit */
+  size_t i, len, lf, lead = 0;
+  int cr;
+
+  if (scan_buf) {
+    outbuf_write(&raw_record, scan_buf + record_start, p->row_pos - record_start);
+    record_start = p->row_pos;
+  }
+
+  /* The LF of a CR LF ending the previous record is only seen now */
+  lf = pending_lf && raw_record.size && raw_record.data[0] == CSV_LF;
+  if (lf && cur_part) {
+    write_part(raw_record.data, 1);
+    chunk_bytes++;
+  } else if (lf) {
+    outbuf_putc(&raw_header, CSV_LF);
+  }
+  len = raw_record.size - lf;
+  cr = len && raw_record.data[raw_record.size-1] == CSV_CR;
+  pending_lf = cr;
+
+  if (first_record) {
+    first_record = 0;
+    if (write_header) {
+      /* Blank lines before the header are not repeated in every chunk */
+      for (i = 0; i < raw_record.size; i++) {
+        if (raw_record.data[i] == CSV_CR || raw_record.data[i] == CSV_LF)
+          lead = i + 1;
+        else if ((raw_record.data[i] != CSV_SPACE && raw_record.data[i] != CSV_TAB)
+                 || raw_record.data[i] == delimiter)
+          break;
+      }
+      make_header(raw_record.data + lead, raw_record.size - lead);
+      raw_record.size = 0;
+      return;
+    }
+  }
+
+  /* A CR ending the record is followed by an LF in the same chunk */
+  if (!cur_part || (max_rows && chunk_rows >= max_rows)
+      || (max_bytes && chunk_rows && chunk_bytes + len + cr > max_bytes))
+    new_chunk();
+
+  write_part(raw_record.data + lf, len);
+  cur_part->count++;
+  chunk_rows++;
+  chunk_bytes += len;
+  raw_record.size = 0;
+}
+
+void
+put_record(struct outbuf *b, struct record *r, size_t count)
+{
+  /* Print the first count fields of r as a CSV record to b, leaving out
+     the key fields with -r */
   int first_field = 1;
   size_t idx;
 
-  for (idx = 0; idx < current_field; idx++) {
-    if (remove_break_field && idx + 1 == break_field)
+  for (idx = 0; idx < count; idx++) {
+    if (remove_break_field && idx < break_field && key_field_flags[idx])
       continue;
 
     if (first_field)
       first_field = 0;
     else
-      fputc(delimiter, cur_file);
+      outbuf_putc(b, delimiter);
 
-    csv_fwrite2(cur_file,
-                entry_array[idx].size ? entry_array[idx].data : "",
-                entry_array[idx].size, quote);
+    outbuf_csv(b, record_field(r, idx), record_field_size(r, idx), quote);
   }
-  fputc('\n', cur_file);
+  outbuf_putc(b, '\n');
+}
+
+void
+print_record(void)
+{
+  struct outbuf *b = part_output();
+  size_t alloc = b->alloc;
+
+  put_record(b, &entries, current_field);
+  buffer_written(alloc);
 }
 
 void
 print_header(void)
 {
-  int first_field = 1;
-  size_t idx;
+  /* The header is printed to header_bytes the first time, when the key
+     fields are known, every new file gets a copy of those bytes */
+  if (max_rows || max_bytes) {
+    /* Chunks get the header as it was read */
+    if (raw_header.size)
+      write_part(raw_header.data, raw_header.size);
+    return;
+  }
 
-  if (header_size == 0)
+  if (header.count == 0)
     return;
 
-  for (idx = 0; idx < header_size; idx++) {
-    if (remove_break_field && idx + 1 == break_field)
-      continue;
+  if (header_bytes.size == 0)
+    put_record(&header_bytes, &header, header.count);
+  write_part(header_bytes.data, header_bytes.size);
+}
 
-    if (first_field)
-      first_field = 0;
-    else
-      fputc(delimiter, cur_file);
+int
+compare_count(const void *a, const void *b)
+{
+  /* Most frequent first, equal counts by value */
+  const file *fa = &file_array[*(const size_t *)a];
+  const file *fb = &file_array[*(const size_t *)b];
 
-    csv_fwrite2(cur_file,
-                header[idx].size ? header[idx].data : "",
-                header[idx].size, quote);
-  }
-  fputc('\n', cur_file);
+  if (fa->count != fb->count)
+    return fa->count > fb->count ? -1 : 1;
+  return compare_value(a, b);
+}
+
+int
+compare_value(const void *a, const void *b)
+{
+  const file *fa = &file_array[*(const size_t *)a];
+  const file *fb = &file_array[*(const size_t *)b];
+  int rv = memcmp(fa->name, fb->name, fa->name_len < fb->name_len ? fa->name_len : fb->name_len);
+
+  if (rv)
+    return rv;
+  return fa->name_len < fb->name_len ? -1 : fa->name_len > fb->name_len;
 }
 
 void
 print_counts(void)
 {
+  /* Without a sort order the values are printed from the last one seen
+     first to the first one seen */
   size_t i = file_array_size;
-  while (i) {
-    i--;
-    printf("%s: %lu\n", file_array[i].name, file_array[i].count);
+  size_t *order;
+
+  if (sort_order == SORT_NONE) {
+    while (i)
+      print_count(&file_array[--i]);
+    return;
   }
+
+  order = xmalloc((file_array_size ? file_array_size : 1) * sizeof *order);
+  for (i = 0; i < file_array_size; i++)
+    order[i] = i;
+  qsort(order, file_array_size, sizeof *order,
+        sort_order == SORT_COUNT ? compare_count : compare_value);
+  for (i = 0; i < file_array_size; i++)
+    print_count(&file_array[order[i]]);
+  free(order);
+}
+
+void
+print_count(file *ptr)
+{
+  /* Print the count of a value, with --top followed by how much too high
+     it may be unless it is exact */
+  if (ptr->error)
+    printf("%s: %lu (+%lu)\n", ptr->name, ptr->count, ptr->error);
+  else
+    printf("%s: %lu\n", ptr->name, ptr->count);
+}
+
+void
+close_files(void)
+{
+  /* Close every open file, which ends their compressed streams */
+  size_t i;
+
+  for (i = 0; i < file_array_size; i++)
+    close_file(i);
 }
 
 void
 remove_files(void)
 {
   size_t i = file_array_size;
+  char *filename;
   while (i--) {
     /* Close file if open, some OSes won't remove an open file */
     if (file_array[i].fp) {
       fclose(file_array[i].fp);
       file_array[i].fp = NULL;  /* So the cleanup function won't close again */
     }
-    remove(file_array[i].filename);
+    if (file_array[i].created)
+      remove(file_array[i].filename);
   }
+
+  for (i = 0; i < finished_files.size; i++)
+    if (finished_files.slots[i].name) {
+      filename = make_file_name(finished_files.slots[i].name);
+      remove(filename);
+      free(filename);
+    }
 }
 
 char *
@@ -405,35 +1688,35 @@ make_file_name(char *name)
 }
 
 void
-cb1 (void *data, size_t len, void *vp)
+make_key_fields(void)
 {
-  if (need_name_resolution) {
-    if ((strlen(break_field_name) == len) && !strncmp(break_field_name, data, len)) {
-      break_field = current_field + 1;
-      need_name_resolution = 0;
-    }
-  }
+  /* Expand the resolved field specs into the list of key fields and set
+     up what is needed to pick them out of records */
+  size_t i;
 
-  /* Check for element to hold entry, create one if needed */
-  if (current_field >= entry_array_size) {
-    entry_array = xrealloc(entry_array, (entry_array_size+1) * sizeof(struct entry));
-    entry_array_size++;
-    entry_array[entry_array_size-1].data = NULL;
-    entry_array[entry_array_size-1].size = 0;
-    entry_array[entry_array_size-1].alloc_size = 0;
-  }
+  key_fields = field_specs_fields(&specs, &key_field_count);
+  for (i = 0; i < key_field_count; i++)
+    if (key_fields[i] > break_field)
+      break_field = key_fields[i];
 
-  /* Element exists at this point, make sure it is large enough */
-  if (entry_array[current_field].alloc_size < len) {
-    entry_array[current_field].data = xrealloc(entry_array[current_field].data, len);
-    entry_array[current_field].alloc_size = len;
-  }
+  key_field_flags = xmalloc(break_field);
+  memset(key_field_flags, 0, break_field);
+  for (i = 0; i < key_field_count; i++)
+    key_field_flags[key_fields[i] - 1] = 1;
 
-  memcpy(entry_array[current_field].data, data, len);
-  entry_array[current_field].size = len;
+  key_parts = xmalloc((2 * key_field_count - 1) * sizeof *key_parts);
+  key_lens = xmalloc((2 * key_field_count - 1) * sizeof *key_lens);
+}
+
+void
+cb1 (void *data, size_t len, void *vp)
+{
+  /* Fields that were not selected are stored empty, data is NULL.  Only
+     the key fields are selected when just printing counts. */
+  record_add(&entries, data, len);
 
   if (current_field + 1 == break_field && !(first_record && write_header))
-    select_file(data, len);
+    select_key();
 
   current_field++;
 }
@@ -441,17 +1724,30 @@ cb1 (void *data, size_t len, void *vp)
 void
 cb2 (int c, void *vp) 
 {
+  if (max_rows || max_bytes) {
+    /* vp is the parser, see main() */
+    chunk_record(vp);
+    return;
+  }
+
   /* No longer first record when first non-empty record seen */
   if (first_record && current_field > 0) {
-    if (write_header)
-      make_header();
-    else
-      if (break_field <= current_field) print_record();
+    if (write_header) {
+      make_header(NULL, 0);
+      if (specs.unresolved) {
+        field_specs_resolve(&specs, &header);
+        if (!specs.unresolved)
+          make_key_fields();
+      }
+    } else
+      if (!just_print_counts && break_field <= current_field) print_record();
     first_record = 0;
+    /* vp is the parser, see main() */
+    select_columns(vp);
   } else {
-    if (need_name_resolution && !first_record) {
+    if (specs.unresolved && !first_record) {
       /* Didn't find field name */
-      fprintf(stderr, "Couldn't find field '%s'\n", break_field_name);
+      fprintf(stderr, "Couldn't find field '%s'\n", field_specs_unresolved_name(&specs));
       exit(EXIT_FAILURE);
     } else {
       if (!just_print_counts)
@@ -460,18 +1756,259 @@ cb2 (int c, void *vp)
   }
 
   current_field = 0;
+  record_reset(&entries);
   current_record++;
 }
 
+void
+chunk_cb1 (void *data, size_t len, void *vp)
+{
+  break_state *st = vp;
+  record_add(&st->entries, data, len);
+}
+
+void
+chunk_cb2 (int c, void *vp)
+{
+  /* Add the record to the group of its break value, the workers only see
+     the records after the first one */
+  break_state *st = vp;
+  const char *key, *nul;
+  size_t key_len, i, count, *values;
+  group *g;
+
+  if (specs.unresolved) {
+    st->chunk->status = CHUNK_NO_FIELD;
+    record_reset(&st->entries);
+    return;
+  }
+
+  if (break_field && break_field <= st->entries.count) {
+    if (key_field_count == 1) {
+      key = record_field(&st->entries, key_fields[0] - 1);
+      key_len = record_field_size(&st->entries, key_fields[0] - 1);
+    } else {
+      st->key.size = 0;
+      for (i = 0; i < key_field_count; i++) {
+        if (i)
+          outbuf_write(&st->key, key_joiner, key_joiner_len);
+        outbuf_write(&st->key, record_field(&st->entries, key_fields[i] - 1),
+                     record_field_size(&st->entries, key_fields[i] - 1));
+      }
+      key = st->key.data;
+      key_len = st->key.size;
+    }
+
+    /* Values that select_file() truncates to the same name must share a
+       group to keep their records in order */
+    if (!buckets && key_len && (nul = memchr(key, '\0', key_len)) != NULL)
+      key_len = nul - key;
+
+    /* Records hashed to one bucket stay in input order.  With --top every
+       record is a group of its own, which value gets replaced depends on
+       the order the counts are increased in.  With --sorted only runs of
+       the same value are grouped so that a value seen again is noticed. */
+    if (buckets) {
+      i = hash_bytes(key, key_len, 0) % buckets;
+    } else if (sorted_input && st->keys.count
+               && record_field_size(&st->keys, st->keys.count - 1) == key_len
+               && !memcmp(record_field(&st->keys, st->keys.count - 1), key, key_len)) {
+      i = st->keys.count - 1;
+    } else if (!top_k && !sorted_input
+               && (values = name_table_find(&st->groups, key, key_len, &count)) != NULL) {
+      i = values[0];
+    } else {
+      i = st->keys.count;
+      if (i == st->group_alloc) {
+        st->group_alloc = st->group_alloc ? st->group_alloc * 2 : 64;
+        st->group_array = xrealloc(st->group_array, st->group_alloc * sizeof *st->group_array);
+      }
+      st->group_array[i].records = 0;
+      outbuf_init(&st->group_array[i].out);
+      record_add(&st->keys, key, key_len);
+      if (!top_k && !sorted_input)
+        name_table_add(&st->groups, key, key_len, i);
+    }
+
+    g = &st->group_array[i];
+    g->records++;
+    if (!just_print_counts)
+      put_record(&g->out, &st->entries, st->entries.count);
+  }
+
+  record_reset(&st->entries);
+}
+
+void
+break_chunk(struct chunk *c, void *arg)
+{
+  /* Parse a chunk.  Until the first record has been seen this is called
+     from the main thread and the records go to the partitions through cb1
+     and cb2 as without --threads.  The workers group the records of a
+     chunk by break value or bucket, each group is stored in c->out as its
+     key length, record count and size followed by the key and the records. */
+  break_state st;
+  size_t i, head[3];
+  group *g;
+
+  if (proj_init(&st.parser, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+    err("Failed to initialize csv parser");
+  proj_set_delim(&st.parser, delimiter);
+  proj_set_quote(&st.parser, quote);
+
+  if (first_record) {
+    select_columns(&st.parser);
+    if (proj_parse(&st.parser, c->data, c->size, cb1, cb2, &st.parser) != c->size
+        || (c->last && proj_fini(&st.parser, cb1, cb2, &st.parser) != 0))
+      c->status = proj_error(&st.parser);
+    proj_free(&st.parser);
+    return;
+  }
+
+  /* column_array is only changed while no workers are busy */
+  if (column_array)
+    proj_set_columns(&st.parser, column_array, break_field);
+  record_init(&st.entries);
+  record_init(&st.keys);
+  outbuf_init(&st.key);
+  name_table_init(&st.groups);
+  st.group_array = NULL;
+  st.group_alloc = 0;
+  st.chunk = c;
+  if (buckets) {
+    st.group_alloc = buckets;
+    st.group_array = xmalloc(buckets * sizeof *st.group_array);
+    for (i = 0; i < buckets; i++) {
+      st.group_array[i].records = 0;
+      outbuf_init(&st.group_array[i].out);
+    }
+  }
+
+  if ((proj_parse(&st.parser, c->data, c->size, chunk_cb1, chunk_cb2, &st) != c->size
+       || (c->last && proj_fini(&st.parser, chunk_cb1, chunk_cb2, &st) != 0))
+      && !c->status)
+    c->status = proj_error(&st.parser);
+
+  for (i = 0; i < (buckets ? buckets : st.keys.count); i++) {
+    g = &st.group_array[i];
+    if (g->records == 0) {
+      outbuf_free(&g->out);
+      continue;
+    }
+    /* With --buckets the bucket number takes the place of the key */
+    head[0] = buckets ? i : record_field_size(&st.keys, i);
+    head[1] = g->records;
+    head[2] = g->out.size;
+    outbuf_write(&c->out, head, sizeof head);
+    if (!buckets)
+      outbuf_write(&c->out, record_field(&st.keys, i), head[0]);
+    if (g->out.size)
+      outbuf_write(&c->out, g->out.data, g->out.size);
+    outbuf_free(&g->out);
+  }
+
+  free(st.group_array);
+  name_table_free(&st.groups);
+  record_free(&st.keys);
+  outbuf_free(&st.key);
+  record_free(&st.entries);
+  proj_free(&st.parser);
+}
 
 int
-main (int argc, char *argv[])
+finish_chunk(struct chunk *c, void *arg)
 {
-  int optc;
-  struct csv_parser p;
+  /* Append the groups of a chunk to their partitions.  Chunks are finished
+     in input order, so every partition gets its records in input order. */
+  char *s = c->out.data, *end = c->out.data + c->out.size;
+  size_t head[3];
+
+  while (s < end) {
+    memcpy(head, s, sizeof head);
+    s += sizeof head;
+
+    if (buckets) {
+      if (file_array_size == 0)
+        add_buckets();
+      cur_part = &file_array[head[0]];
+      cur_part->count += head[1];
+    } else {
+      select_file((const char **)&s, &head[0], 1);
+      s += head[0];
+      /* select_file() counted the first record of the group */
+      cur_part->count += head[1] - 1;
+      if (top_k)
+        heap_down(cur_part->heap_pos);
+    }
+
+    if (head[2])
+      write_part(s, head[2]);
+    s += head[2];
+  }
+
+  if (c->status == CHUNK_NO_FIELD) {
+    fprintf(stderr, "Couldn't find field '%s'\n", field_specs_unresolved_name(&specs));
+    return 1;
+  }
+  if (c->status) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(c->status));
+    return 1;
+  }
+  return 0;
+}
+
+void
+break_file(void)
+{
+  struct proj_parser p;
   size_t bytes_read;
   char buf[1024];
 
+#ifndef WITHOUT_THREADS
+  if (threads > 1) {
+    /* The header and the break field name are handled before workers start */
+    if (parallel_chunks(infile, threads, delimiter, quote, break_chunk, finish_chunk, NULL, &first_record))
+      exit(EXIT_FAILURE);
+    return;
+  }
+#endif
+
+  proj_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0);
+  proj_set_delim(&p, delimiter);
+  proj_set_quote(&p, quote);
+  select_columns(&p);
+
+  while ((bytes_read=fread(buf, 1, 1024, infile)) > 0) {
+    scan_buf = buf;
+    record_start = 0;
+    if (proj_parse(&p, buf, bytes_read, cb1, cb2, &p) != bytes_read) {
+      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+      exit(EXIT_FAILURE);
+    }
+    /* Keep the start of a record continued in the next buffer */
+    if (max_rows || max_bytes)
+      outbuf_write(&raw_record, buf + record_start, bytes_read - record_start);
+  }
+
+  scan_buf = NULL;
+  if (proj_fini(&p, cb1, cb2, &p)) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+    exit(EXIT_FAILURE);
+  }
+
+  /* Blank lines at the end of the input */
+  if (cur_part && raw_record.size)
+    write_part(raw_record.data, raw_record.size);
+
+  proj_free(&p);
+}
+
+
+int
+main (int argc, char *argv[])
+{
+  int optc;
+
   program_name = argv[0];
 
   while ((optc = getopt_long(argc, argv, "cd:f:hq:rsS:P:", longopts, NULL)) != -1)
@@ -518,6 +2055,7 @@ main (int argc, char *argv[])
 
       case 'S':
         filename_suffix = optarg;
+        suffix_given = 1;
         break;
 
       case CHAR_MAX + 1:
@@ -530,19 +2068,155 @@ main (int argc, char *argv[])
         usage(EXIT_SUCCESS);
         break;
 
+      case CHAR_MAX + 3:
+        /* --max-open-files */
+        if (!Is_numeric(optarg) || (max_open_files = strtoul(optarg, NULL, 10)) < 1)
+          err("the number of open files must be a positive number");
+        break;
+
+      case CHAR_MAX + 4:
+        /* --stats */
+        show_stats = 1;
+        break;
+
+      case CHAR_MAX + 5:
+        /* --memory */
+        if (Parse_size(optarg, &memory_limit) != 0)
+          err("Invalid memory size");
+        break;
+
+      case CHAR_MAX + 6:
+        /* --buckets */
+        if (!Is_numeric(optarg) || (buckets = strtoul(optarg, NULL, 10)) < 1)
+          err("the number of buckets must be a positive number");
+        break;
+
+      case CHAR_MAX + 7:
+        /* --max-rows */
+        if (!Is_numeric(optarg) || (max_rows = strtoul(optarg, NULL, 10)) < 1)
+          err("the number of rows must be a positive number");
+        break;
+
+      case CHAR_MAX + 8:
+        /* --max-bytes */
+        if (Parse_size(optarg, &max_bytes) != 0 || max_bytes < 1)
+          err("Invalid chunk size");
+        break;
+
+      case CHAR_MAX + 9:
+        /* --top */
+        if (!Is_numeric(optarg) || (top_k = strtoul(optarg, NULL, 10)) < 1)
+          err("the number of values must be a positive number");
+        just_print_counts = 1;
+        if (sort_order == SORT_NONE)
+          sort_order = SORT_COUNT;
+        break;
+
+      case CHAR_MAX + 10:
+        /* --sort */
+        if (!strcmp(optarg, "count"))
+          sort_order = SORT_COUNT;
+        else if (!strcmp(optarg, "value"))
+          sort_order = SORT_VALUE;
+        else
+          err("the sort order must be count or value");
+        break;
+
+      case CHAR_MAX + 11:
+        /* --threads */
+        if (!Is_numeric(optarg) || (threads = atoi(optarg)) < 1)
+          err("the number of threads must be a positive number");
+#ifdef WITHOUT_THREADS
+        if (threads > 1)
+          err("not compiled with thread support");
+#endif
+        break;
+
+      case CHAR_MAX + 12:
+        /* --compress */
+        if (!strcmp(optarg, "gzip"))
+          compress_method = COMPRESS_GZIP;
+        else if (!strcmp(optarg, "zstd"))
+          compress_method = COMPRESS_ZSTD;
+        else
+          err("the compression method must be gzip or zstd");
+#ifdef WITHOUT_ZLIB
+        if (compress_method == COMPRESS_GZIP)
+          err("not compiled with gzip support");
+#endif
+#ifndef WITH_ZSTD
+        if (compress_method == COMPRESS_ZSTD)
+          err("not compiled with zstd support");
+#endif
+        break;
+
+      case CHAR_MAX + 13:
+        /* --compress-threads */
+        if (!Is_numeric(optarg) || (compress_threads = atoi(optarg)) < 1)
+          err("the number of threads must be a positive number");
+#ifdef WITHOUT_THREADS
+        err("not compiled with thread support");
+#endif
+        break;
+
+      case CHAR_MAX + 14:
+        /* --joiner */
+        key_joiner = optarg;
+        key_joiner_len = strlen(optarg);
+        break;
+
+      case CHAR_MAX + 15:
+        /* --sorted */
+        if (optarg == NULL || !strcmp(optarg, "error"))
+          sorted_input = SORTED_ERROR;
+        else if (!strcmp(optarg, "append"))
+          sorted_input = SORTED_APPEND;
+        else
+          err("--sorted must be followed by error or append");
+        break;
+
+      case CHAR_MAX + 16:
+        /* --spill */
+        spill = 1;
+        break;
+
       default:
         usage(EXIT_FAILURE);
     }
 
   atexit(cleanup);
+  run_list_init(&runs, merge_runs);
 
-  if (!break_field_name)
-    err("Must specify a field to break on");
+  if (sorted_input && (just_print_counts || buckets))
+    err("--sorted cannot be used with -c, --top or --buckets");
 
-  if (Is_numeric(break_field_name))
-    break_field = strtoul(break_field_name, NULL, 10);
-  else
-    write_header = need_name_resolution = 1;
+  if (spill && (sorted_input || max_rows || max_bytes))
+    err("--spill cannot be used with --sorted, --max-rows or --max-bytes");
+
+  if (top_k) {
+    if (buckets)
+      err("--top cannot be used with --buckets");
+    count_heap = xmalloc(top_k * sizeof *count_heap);
+  }
+
+  if (max_rows || max_bytes) {
+    if (break_field_name || just_print_counts || remove_break_field || buckets || threads > 1)
+      err("--max-rows and --max-bytes cannot be used with -f, -c, -r, --buckets or --threads");
+  } else {
+    if (!break_field_name)
+      err("Must specify a field to break on");
+
+    field_specs_parse(&specs, break_field_name, 0);
+    if (specs.unresolved)
+      write_header = 1;
+    else
+      make_key_fields();
+  }
+
+  if (compress_method == COMPRESS_NONE)
+    compress_threads = 0;
+  else if (!suffix_given)
+    filename_suffix = compress_method == COMPRESS_GZIP ? ".csv.gz" : ".csv.zst";
 
   if (optind < argc) {
     if (optind + 1 < argc)
@@ -554,26 +2228,37 @@ main (int argc, char *argv[])
     infile = stdin;
   }
 
-  csv_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0);
-  csv_set_delim(&p, delimiter);
-  csv_set_quote(&p, quote);
+  if (compress_threads && !just_print_counts)
+    start_compress_threads();
 
-  while ((bytes_read=fread(buf, 1, 1024, infile)) > 0) {
-    if (csv_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
-      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-      exit(EXIT_FAILURE);
-    }
-  }
+  break_file();
 
-  if (csv_fini(&p, cb1, cb2, NULL)) {
-    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-    exit(EXIT_FAILURE);
-  }
-
-  csv_free(&p);
+  /* Every bucket is created even if no record was seen */
+  if (buckets && file_array_size == 0)
+    add_buckets();
 
   if (just_print_counts)
     print_counts();
+  else {
+    if (runs.count) {
+      /* The partitions are written from the runs, the ones without any
+         output are created by flush_files() */
+      spill_run();
+      merge_runs(runs.runs, runs.count, NULL);
+      runs.count = 0;
+    } else if (spill)
+      write_spilled();
+    flush_files();
+    close_files();
+    stop_compress_threads();
+  }
+
+  if (show_stats) {
+    fprintf(stderr, "%lu files opened, %lu closed, %lu reopened\n",
+            files_opened, files_closed, files_reopened);
+    if (spill)
+      fprintf(stderr, "%lu runs spilled\n", runs_spilled);
+  }
 
   call_remove_files = 0;
   exit(EXIT_SUCCESS);
@@ -85,6 +85,7 @@ void cb1 (void *s, size_t len, void *data);
 void cb2 (int c, void *data);
 void usage (int status);
 void count_file(char *filename);
+int count_columnar(FILE *fp);
 
 void
 cb1 (void *s, size_t len, void *data)
@@ -121,6 +122,35 @@ Print the number of fields and rows in a CSV file.\n\
 }
 
 
+int
+count_columnar(FILE *fp)
+{
+  /* Count the rows and the fields present in a columnar file written by
+     csvcut --columnar, the magic number has already been read */
+  struct columnar_reader r;
+  size_t i, j, len;
+  int rv;
+
+  if (columnar_open(&r, fp, 1) != 0) {
+    columnar_close(&r);
+    return -1;
+  }
+
+  while ((rv = columnar_read_group(&r)) > 0) {
+    rows += r.rows;
+    total_rows += r.rows;
+    for (i = 0; i < r.columns; i++)
+      for (j = 0; j < r.rows; j++)
+        if (columnar_field(&r, i, j, &len) != NULL) {
+          fields++;
+          total_fields++;
+        }
+  }
+
+  columnar_close(&r);
+  return rv;
+}
+
 void
 count_file(char *filename)
 {
@@ -147,16 +177,28 @@ count_file(char *filename)
     }
   }
 
-  while ((bytes_read=fread(buf, 1, 1024, fp)) > 0) {
-    if (csv_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
-      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-      csv_free(&p);
+  /* Files written by csvcut --columnar are recognized by their magic number */
+  bytes_read = fread(buf, 1, COLUMNAR_MAGIC_SIZE, fp);
+  if (bytes_read == COLUMNAR_MAGIC_SIZE && !memcmp(buf, COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE)) {
+    csv_free(&p);
+    if (count_columnar(fp) != 0) {
+      fprintf(stderr, "Error while reading columnar file %s\n", filename ? filename : "");
+      fclose(fp);
       return;
     }
-  }
+  } else {
+    while (bytes_read > 0) {
+      if (csv_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
+        fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
+        csv_free(&p);
+        return;
+      }
+      bytes_read = fread(buf, 1, 1024, fp);
+    }
 
-  csv_fini(&p, cb1, cb2, NULL);
-  csv_free(&p);
+    csv_fini(&p, cb1, cb2, NULL);
+    csv_free(&p);
+  }
 
   if (ferror(fp)) {
     fprintf(stderr, "Error reading file %s\n", filename);
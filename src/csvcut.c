@@ -33,19 +33,15 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define PROGRAM_NAME "csvcut"
 #define AUTHORS "Robert Gamble"
 
-typedef struct entry {
-  size_t size;       /* The size of the current entry */
-  size_t alloc_size; /* The size allocated for data */
-  char *data;        /* The field data */
-} entry;
-
-/* Each field specification is stored in a field_spec structure */
-typedef struct field_spec {
-  char *start_name;
-  char *stop_name;
-  size_t start_value;
-  size_t stop_value;
-} field_spec;
+/* Output is written once this much is buffered */
+#define OUTPUT_FLUSH_SIZE 65536
+
+/* The state of one parse, with --threads each chunk gets its own */
+typedef struct cut_state {
+  struct proj_parser parser;  /* The parser calling cb1 and cb2 */
+  struct record entries;      /* The fields of the current record */
+  struct outbuf *out;         /* Where selected fields are printed */
+} cut_state;
 
 static struct option const longopts[] =
 {
@@ -58,12 +54,12 @@ static struct option const longopts[] =
   {"reresolve-fields", no_argument, NULL, 'r'},
   {"version", no_argument, NULL, CHAR_MAX + 1},
   {"help", no_argument, NULL, CHAR_MAX + 2},
+  {"threads", required_argument, NULL, CHAR_MAX + 3},
+  {"columnar", no_argument, NULL, CHAR_MAX + 4},
+  {"row-group", required_argument, NULL, CHAR_MAX + 5},
   {NULL, 0, NULL, 0}
 };
 
-/* The current csv field being processed, starting at 0 */
-size_t current_field;         
-
 /* if set output all fields except those selected */
 int complement;
 
@@ -82,26 +78,17 @@ char *delimiter_string;
 /* strict mode in effect if set */
 int strict;
 
-/* The number of fields waiting for name resolution */
-int unresolved_fields;
-
 /* The name this program was called with */
 char *program_name;
 
 /* The current output file */
 FILE *outfile;
 
-/* Pointer to the array of entries */
-entry *entry_array;
-
-/* Pointer to the array of field specifications */
-field_spec *field_spec_array;
+/* Output waiting to be written to outfile */
+struct outbuf output;
 
-/* Size of the field_spec_array */
-size_t field_spec_size;
-
-/* The current size of the entry array */
-size_t entry_array_size;
+/* The field specifications */
+struct field_specs specs;
 
 /* The field specifications passed to the program */
 char *field_spec_arg;
@@ -115,17 +102,54 @@ int make_empty_fields;
 /* If set, re-resolve field names for every file */
 int reresolve;
 
+/* Flags for the fields the parser needs to pass to cb1 */
+unsigned char *column_array;
+
+/* The number of elements in column_array */
+size_t column_array_size;
+
+/* The number of threads to use */
+int threads = 1;
+
+/* Write the columnar format instead of CSV if set */
+int columnar;
+
+/* The number of rows in each row group of the columnar format */
+size_t row_group_size = 65536;
+
+/* The field numbers of the columns written in the columnar format */
+size_t *columnar_fields;
+
+/* The number of elements in columnar_fields */
+size_t columnar_size;
+
+/* Set once the columnar file header has been written */
+int columnar_started;
+
+/* Per column field offsets, field lengths and field bytes of the current
+   row group */
+struct outbuf *column_offsets;
+struct outbuf *column_lengths;
+struct outbuf *column_heaps;
+
+/* The number of rows in the current row group */
+size_t group_rows;
+
 /* Function Prototypes */
 void cb1 (void *s, size_t len, void *data);
 void cb2 (int c, void *data);
-void field_spec_cb1 (void *s, size_t len, void *data);
-void field_spec_cb2 (int c, void *data);
 void cut_file(char *filename);
+void init_state(cut_state *st, struct outbuf *out);
+void free_state(cut_state *st);
+void cut_chunk(struct chunk *c, void *arg);
+int finish_chunk(struct chunk *c, void *arg);
 void usage (int status);
-void add_field_spec(char *start, char *stop, size_t start_value, size_t stop_value);
-void process_field_specs(char *f);
 void print_unresolved_fields(void);
-void unresolve_fields(void);
+void select_columns(struct proj_parser *p);
+void start_columns(struct record *header);
+void columnar_row(cut_state *st);
+void write_row_group(void);
+void write_output(struct outbuf *b);
 void cleanup(void);
 
 
@@ -133,49 +157,188 @@ void cleanup(void);
 void
 cleanup(void)
 {
-  /* Free memory for entry_array */
+  /* Free memory for the output buffer */
   /* Only to be called once by atexit! */
   size_t i;
-  for (i = 0; i < entry_array_size; i++)
-    free(entry_array[i].data);
-  free(entry_array);
+
+  outbuf_free(&output);
+  field_specs_free(&specs);
+  free(column_array);
+  for (i = 0; i < columnar_size; i++) {
+    outbuf_free(&column_offsets[i]);
+    outbuf_free(&column_lengths[i]);
+    outbuf_free(&column_heaps[i]);
+  }
+  free(column_offsets);
+  free(column_lengths);
+  free(column_heaps);
+  free(columnar_fields);
 }
 
 void
 print_unresolved_fields(void)
 {
   /* Print the first unresolved field name found and exit */
-  size_t i;
-  fprintf(stderr, "Unable to resolve the field ");
-  for (i = 0; i < field_spec_size; i++) {
-    if (field_spec_array[i].start_name != NULL && field_spec_array[i].start_value == 0) {
-      fprintf(stderr, "'%s' ", field_spec_array[i].start_name);
-      break;
+  fprintf(stderr, "Unable to resolve the field '%s' ", field_specs_unresolved_name(&specs));
+  puts("");
+  exit(EXIT_FAILURE);
+}
+
+void
+select_columns(struct proj_parser *p)
+{
+  /* Tell the parser which fields are needed once all field names are
+     resolved so that the remaining fields are not copied at all, if p is
+     NULL only the column array is updated */
+  size_t i, j;
+
+  if (complement || specs.unresolved)
+    return;
+
+  column_array_size = 0;
+  for (i = 0; i < specs.count; i++)
+    if (specs.specs[i].stop_value > column_array_size)
+      column_array_size = specs.specs[i].stop_value;
+
+  column_array = xrealloc(column_array, column_array_size ? column_array_size : 1);
+  memset(column_array, 0, column_array_size);
+  for (i = 0; i < specs.count; i++)
+    for (j = specs.specs[i].start_value; j <= specs.specs[i].stop_value; j++)
+      column_array[j-1] = 1;
+
+  if (p)
+    proj_set_columns(p, column_array, column_array_size);
+}
+
+void
+start_columns(struct record *header)
+{
+  /* Fix the columns of the columnar format and write the file header once
+     the field specs are resolved.  The columns are named after the fields
+     of the header record if field names were used, by number otherwise. */
+  size_t i, j, n = 0, alloc = 16;
+  size_t *fields = xmalloc(alloc * sizeof *fields);
+  struct outbuf b;
+  char num[32];
+
+  for (i = 0; i < specs.count; i++)
+    for (j = specs.specs[i].start_value; j <= specs.specs[i].stop_value; j++) {
+      if (n == alloc)
+        fields = xrealloc(fields, (alloc *= 2) * sizeof *fields);
+      fields[n++] = j;
     }
-    if (field_spec_array[i].stop_name != NULL && field_spec_array[i].stop_value == 0) {
-      fprintf(stderr, "'%s' ", field_spec_array[i].stop_name);
-      break;
+
+  if (columnar_started) {
+    /* With -r every file must resolve to the same columns */
+    if (n != columnar_size || memcmp(fields, columnar_fields, n * sizeof *fields))
+      err("The field list must select the same fields in every file with --columnar");
+    free(fields);
+    return;
+  }
+
+  columnar_started = 1;
+  columnar_fields = fields;
+  columnar_size = n;
+  column_offsets = xmalloc((n ? n : 1) * sizeof *column_offsets);
+  column_lengths = xmalloc((n ? n : 1) * sizeof *column_lengths);
+  column_heaps = xmalloc((n ? n : 1) * sizeof *column_heaps);
+
+  outbuf_init(&b);
+  outbuf_write(&b, COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE);
+  outbuf_put64(&b, COLUMNAR_VERSION);
+  outbuf_put64(&b, n);
+  outbuf_put64(&b, row_group_size);
+  for (i = 0; i < n; i++) {
+    outbuf_init(&column_offsets[i]);
+    outbuf_init(&column_lengths[i]);
+    outbuf_init(&column_heaps[i]);
+    if (header && fields[i] <= header->count) {
+      outbuf_put64(&b, record_field_size(header, fields[i]-1));
+      outbuf_write(&b, record_field(header, fields[i]-1), record_field_size(header, fields[i]-1));
+    } else {
+      sprintf(num, "%lu", (long unsigned)fields[i]);
+      outbuf_put64(&b, strlen(num));
+      outbuf_write(&b, num, strlen(num));
     }
+    outbuf_pad64(&b);
   }
-  puts("");
-  exit(EXIT_FAILURE);
+  outbuf_flush(&b, outfile);
+  outbuf_free(&b);
 }
 
 void
-unresolve_fields(void)
+columnar_row(cut_state *st)
 {
-  /* Unresolve all field thats originally needed resolving for -? option */
-  size_t i;
-  for (i = 0; i < field_spec_size; i++) {
-    if (field_spec_array[i].start_name != NULL) {
-      field_spec_array[i].start_value = 0;
-      unresolved_fields++;
+  /* Encode the selected fields of a row for write_output(), each field is
+     stored as its length followed by its bytes.  Missing fields have a
+     length of -1 unless empty fields are made for them. */
+  size_t i, len, absent = (size_t)-1, empty = 0;
+
+  for (i = 0; i < columnar_size; i++) {
+    if (columnar_fields[i] > st->entries.count) {
+      outbuf_write(st->out, make_empty_fields ? &empty : &absent, sizeof(size_t));
+      continue;
     }
-    if (field_spec_array[i].stop_name != NULL) {
-      field_spec_array[i].stop_value = 0;
-      unresolved_fields++;
+    len = record_field_size(&st->entries, columnar_fields[i]-1);
+    outbuf_write(st->out, &len, sizeof len);
+    outbuf_write(st->out, record_field(&st->entries, columnar_fields[i]-1), len);
+  }
+}
+
+void
+write_row_group(void)
+{
+  /* Write the current row group to outfile */
+  struct outbuf b;
+  size_t i;
+
+  if (group_rows == 0)
+    return;
+
+  outbuf_init(&b);
+  outbuf_put64(&b, group_rows);
+  outbuf_flush(&b, outfile);
+  for (i = 0; i < columnar_size; i++) {
+    outbuf_put64(&b, column_heaps[i].size);
+    outbuf_flush(&b, outfile);
+    outbuf_flush(&column_offsets[i], outfile);
+    outbuf_flush(&column_lengths[i], outfile);
+    outbuf_pad64(&column_heaps[i]);
+    outbuf_flush(&column_heaps[i], outfile);
+  }
+  outbuf_free(&b);
+  group_rows = 0;
+}
+
+void
+write_output(struct outbuf *b)
+{
+  /* Write buffered output to outfile, with --columnar the buffer holds rows
+     encoded by columnar_row() which are added to the current row group */
+  size_t i, len, pos = 0;
+
+  if (!columnar) {
+    outbuf_flush(b, outfile);
+    return;
+  }
+
+  while (pos < b->size) {
+    for (i = 0; i < columnar_size; i++) {
+      memcpy(&len, b->data + pos, sizeof len);
+      pos += sizeof len;
+      outbuf_put64(&column_offsets[i], column_heaps[i].size);
+      if (len == (size_t)-1) {
+        outbuf_put64(&column_lengths[i], COLUMNAR_ABSENT);
+      } else {
+        outbuf_put64(&column_lengths[i], len);
+        outbuf_write(&column_heaps[i], b->data + pos, len);
+        pos += len;
+      }
     }
+    if (++group_rows == row_group_size)
+      write_row_group();
   }
+  b->size = 0;
 }
 
 void
@@ -204,6 +367,11 @@ Print selected fields of CSV files or CSV data received from standard input\n\
   -c, --complement             output all fields except those specified\n\
   -m, --make-empty-fields      cause the creation of empty fields for those\n\
                                specified in the field specs but not in the data\n\
+      --threads=N              use N threads to process each file\n\
+      --columnar               write the selected fields in a columnar binary\n\
+                               format instead of CSV\n\
+      --row-group=N            put N rows in each row group of the columnar\n\
+                               format\n\
       --version                display version information and exit\n\
       --help                   display this help and exit\n\
 ");
@@ -211,61 +379,63 @@ Print selected fields of CSV files or CSV data received from standard input\n\
   exit(status);
 }
 
-int
-not_a_space(unsigned char c)
+void
+init_state(cut_state *st, struct outbuf *out)
 {
-  /* Preserve spaces when parsing field specs */
-  return 0;
+  if (proj_init(&st->parser, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+    err("Failed to initialize csv parser");
+
+  proj_set_delim(&st->parser, delimiter);
+  proj_set_quote(&st->parser, quote);
+  record_init(&st->entries);
+  st->out = out;
 }
 
 void
-process_field_specs(char *f)
+free_state(cut_state *st)
 {
-  struct csv_parser p;
-  size_t len = strlen(f);
-  if (csv_init(&p, CSV_STRICT|CSV_STRICT_FINI))
-    err("Failed to initialize csv parser");
+  proj_free(&st->parser);
+  record_free(&st->entries);
+}
 
-  csv_set_space_func(&p, not_a_space);
+void
+cut_chunk(struct chunk *c, void *arg)
+{
+  /* Cut the records in a chunk, called from the worker threads */
+  cut_state st;
 
-  if (csv_parse(&p, f, len, field_spec_cb1, field_spec_cb2, NULL) != len)
-    err("Invalid field spec");
+  init_state(&st, &c->out);
+  /* column_array is only changed while no workers are busy */
+  if (!complement && !specs.unresolved)
+    proj_set_columns(&st.parser, column_array, column_array_size);
 
-  if (csv_fini(&p, field_spec_cb1, field_spec_cb2, NULL))
-    err("Invalid field spec");
+  if (proj_parse(&st.parser, c->data, c->size, cb1, cb2, &st) != c->size
+      || (c->last && proj_fini(&st.parser, cb1, cb2, &st) != 0))
+    c->status = proj_error(&st.parser);
 
-  if (field_spec_size == 0)
-    err("Field list cannot be empty");
+  free_state(&st);
 }
 
-
-void
-add_field_spec(char *start, char *stop, size_t start_value, size_t stop_value)
+int
+finish_chunk(struct chunk *c, void *arg)
 {
-  field_spec *ptr;
-  field_spec_array = xrealloc(field_spec_array, (field_spec_size+1) * sizeof(field_spec));
-  field_spec_size++;
-  ptr = &field_spec_array[field_spec_size-1];
-  ptr->start_name = start;
-  ptr->stop_name = stop;
-  ptr->start_value = start_value;
-  ptr->stop_value = stop_value;
+  /* Write the output of a chunk, stop at the first error like cut_file */
+  write_output(&c->out);
+  if (c->status) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(c->status));
+    return 1;
+  }
+  return 0;
 }
 
 void
 cut_file(char *filename)
 {
   FILE *fp;
-  struct csv_parser p;
+  cut_state st;
   char buf[1024];
   size_t bytes_read;
 
-  if (csv_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
-    err("Failed to initialize csv parser");
-
-  csv_set_delim(&p, delimiter);
-  csv_set_quote(&p, quote);
-
   if (filename == NULL || !strcmp(filename, "-")) {
     fp = stdin;
   } else {
@@ -274,27 +444,48 @@ cut_file(char *filename)
 
   if (!fp) {
     fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
-    csv_free(&p);
     return;
   }
 
+  select_columns(NULL);
+
+#ifndef WITHOUT_THREADS
+  if (threads > 1) {
+    /* Names are resolved from the first record before workers start */
+    parallel_chunks(fp, threads, delimiter, quote, cut_chunk, finish_chunk, NULL, &first_record);
+    if (ferror(fp))
+      fprintf(stderr, "Error reading file %s\n", filename);
+    fclose(fp);
+    return;
+  }
+#endif
+
+  init_state(&st, &output);
+  if (!complement && !specs.unresolved)
+    proj_set_columns(&st.parser, column_array, column_array_size);
+
   while ((bytes_read=fread(buf, 1, 1024, fp)) > 0) {
-    if (csv_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
-      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-      csv_free(&p);
+    if (proj_parse(&st.parser, buf, bytes_read, cb1, cb2, &st) != bytes_read) {
+      write_output(&output);
+      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&st.parser)));
+      free_state(&st);
       fclose(fp);
       return;
     }
+    if (output.size >= OUTPUT_FLUSH_SIZE)
+      write_output(&output);
   }
 
-  if (csv_fini(&p, cb1, cb2, NULL) != 0) {
-    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-    csv_free(&p);
+  if (proj_fini(&st.parser, cb1, cb2, &st) != 0) {
+    write_output(&output);
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&st.parser)));
+    free_state(&st);
     fclose(fp);
     return;
   }
 
-  csv_free(&p);
+  write_output(&output);
+  free_state(&st);
 
   if (ferror(fp)) {
     fprintf(stderr, "Error reading file %s\n", filename);
@@ -305,168 +496,77 @@ cut_file(char *filename)
   fclose(fp);
 }
 
-void
-field_spec_cb1(void *s, size_t len, void *data)
-{
-  size_t left_size = 0, right_size = 0;
-  long unsigned left_value = 0, right_value = 0;
-  char *left = NULL, *right = NULL;
-  char *ptr, *field;
-  int left_ended = 0;
-
-  left = ptr = field = Strndup(s, len);
-
-  while (*ptr) {
-    if (*ptr == '-') {
-      if (left_ended || left_size == 0)
-        err("Invalid field spec");
-      left = Strndup(s, left_size);
-      if (Is_numeric(left)) {
-        left_value = strtoul(left, NULL, 10);
-        if (left_value == 0)
-          err("0 is not a valid field index");
-      } else
-        unresolved_fields++;
-      left_ended = 1;
-      right = ++ptr;
-    } else {
-      if (left_ended) {
-        right_size++;
-      } else {
-        left_size++;
-      }
-      ptr++;
-    }
-  }
-
-  if (left_ended) {
-    right = Strndup(right, right_size);
-    if (Is_numeric(right)) {
-      right_value = strtoul(right, NULL, 10);
-      if (right_value == 0)
-        err("0 is not a valid field index");
-    } else
-      unresolved_fields++;
-  } else {
-    left = Strndup(s, left_size);
-    if (Is_numeric(left)) {
-      left_value = strtoul(left, NULL, 10);
-      if (left_value == 0)
-        err("0 is not a valid field index");
-    } else {
-      right = Strndup(left, left_size);
-      unresolved_fields+=2;
-    }
-    right_value = left_value;
-  }
-  /* printf("left = %d (%s), right = %d (%s)\n", left_value, left, right_value, right); */
-  if (left_value != 0) {
-    free(left);
-    left = NULL;
-  }
-  if (right_value != 0) {
-    free(right);
-    right = NULL;
-  }
-
-  add_field_spec(left, right, left_value, right_value);
-}
-
-void
-field_spec_cb2(int c, void *data)
-{
-  /* Field spec should not contain newlines */
-  if (c >= 0)
-    err("Invalid field spec");
-}
-
 void
 cb1 (void *s, size_t len, void *data)
 {
-  size_t i = 0;
-
-  if (unresolved_fields) {
-    if (first_record) {
-      while (i < field_spec_size) {
-        if (field_spec_array[i].start_value == 0 
-            && strlen(field_spec_array[i].start_name) == len 
-            && !strncmp(field_spec_array[i].start_name, s, len)) {
-              field_spec_array[i].start_value = current_field+1;
-              unresolved_fields--;
-        }
-        if (field_spec_array[i].stop_value == 0 
-            && strlen(field_spec_array[i].stop_name) == len 
-            && !strncmp(field_spec_array[i].stop_name, s, len)) {
-              field_spec_array[i].stop_value = current_field+1;
-              unresolved_fields--;
-        }
-        i++;
-      }
-    }
-  }
-
-  /* Check for element to hold entry, create one if needed */
-  if (current_field >= entry_array_size) {
-    entry_array = xrealloc(entry_array, (entry_array_size+1) * sizeof(struct entry));
-    entry_array_size++;
-    entry_array[entry_array_size-1].data = NULL;
-    entry_array[entry_array_size-1].size = 0;
-    entry_array[entry_array_size-1].alloc_size = 0;
-  }
+  cut_state *st = data;
 
-  /* Element exists at this point, make sure it is large enough */
-  if (entry_array[current_field].alloc_size < len) {
-    entry_array[current_field].data = xrealloc(entry_array[current_field].data, len);
-    entry_array[current_field].alloc_size = len;
-  }
-
-  memcpy(entry_array[current_field].data, s, len);
-  entry_array[current_field].size = len;
-
-  current_field++;
+  /* Fields that were not selected are stored empty, s is NULL */
+  record_add(&st->entries, s, len);
 }
 
 void
 cb2 (int c, void *data)
 {
+  cut_state *st = data;
+  struct outbuf *out = st->out;
+  size_t current_field = st->entries.count;
   size_t i, j; 
   int first_field = 1;
+  int is_header;
 
-  if (first_record && current_field > 0)
+  if (first_record && current_field > 0) {
     first_record = 0;
+    is_header = specs.unresolved > 0;
+    if (specs.unresolved)
+      field_specs_resolve(&specs, &st->entries);
+    if (specs.unresolved)
+      print_unresolved_fields();
+    select_columns(&st->parser);
+    if (columnar) {
+      /* The names of the header record are kept in the file header */
+      start_columns(is_header ? &st->entries : NULL);
+      if (is_header) {
+        record_reset(&st->entries);
+        return;
+      }
+    }
+  }
 
-  if (unresolved_fields && !first_record)
-    print_unresolved_fields();
+  if (columnar) {
+    columnar_row(st);
+    record_reset(&st->entries);
+    return;
+  }
 
   if (complement) {
     for (i = 1; i <= current_field; i++) {
-      for (j = 0; j < field_spec_size; j++) {
-        if (i >= field_spec_array[j].start_value && i <= field_spec_array[j].stop_value)
+      for (j = 0; j < specs.count; j++) {
+        if (i >= specs.specs[j].start_value && i <= specs.specs[j].stop_value)
           goto dont_print;
       }
       /* If got this far, output field */
       if (first_field)
         first_field = 0;
       else
-        fputc(delimiter, outfile);
-      csv_fwrite2(outfile, 
-                  entry_array[i-1].size ? entry_array[i-1].data : "",
-                  entry_array[i-1].size, quote);
+        outbuf_putc(out, delimiter);
+      outbuf_csv(out, record_field(&st->entries, i-1),
+                 record_field_size(&st->entries, i-1), quote);
       dont_print:
         ;
     }
   } else {
     /* Print the fields according to the field specs */
-    for (i = 0; i < field_spec_size; i++) {
-      for (j = field_spec_array[i].start_value;
-           j <= field_spec_array[i].stop_value;
+    for (i = 0; i < specs.count; i++) {
+      for (j = specs.specs[i].start_value;
+           j <= specs.specs[i].stop_value;
            j++) {
         if (j > current_field)
           if (make_empty_fields)
             if (!first_field) {
-              fputc(delimiter, outfile);
-              fputc(quote, outfile);
-              fputc(quote, outfile);
+              outbuf_putc(out, delimiter);
+              outbuf_putc(out, quote);
+              outbuf_putc(out, quote);
             } else 
               first_field = 0;
           else
@@ -475,17 +575,16 @@ cb2 (int c, void *data)
           if (first_field)
             first_field = 0;
           else
-            fputc(delimiter, outfile);
-          csv_fwrite2(outfile,
-                      entry_array[j-1].size ?  entry_array[j-1].data : "",
-                      entry_array[j-1].size, quote);
+            outbuf_putc(out, delimiter);
+          outbuf_csv(out, record_field(&st->entries, j-1),
+                     record_field_size(&st->entries, j-1), quote);
         }
       }
     }
   }
   
-  current_field = 0;
-  putc('\n', outfile);
+  record_reset(&st->entries);
+  outbuf_putc(out, '\n');
 }
 
 int
@@ -543,6 +642,27 @@ main (int argc, char *argv[])
         usage(EXIT_SUCCESS);
         break;
 
+      case CHAR_MAX + 3:
+        /* --threads */
+        if (!Is_numeric(optarg) || (threads = atoi(optarg)) < 1)
+          err("the number of threads must be a positive number");
+#ifdef WITHOUT_THREADS
+        if (threads > 1)
+          err("not compiled with thread support");
+#endif
+        break;
+
+      case CHAR_MAX + 4:
+        /* --columnar */
+        columnar = 1;
+        break;
+
+      case CHAR_MAX + 5:
+        /* --row-group */
+        if (!Is_numeric(optarg) || (row_group_size = strtoul(optarg, NULL, 10)) < 1)
+          err("the row group size must be a positive number");
+        break;
+
       default:
         usage(EXIT_FAILURE);
     }
@@ -550,17 +670,20 @@ main (int argc, char *argv[])
   atexit(cleanup);
 
   if (field_spec_arg)
-    process_field_specs(field_spec_arg);
+    field_specs_parse(&specs, field_spec_arg, 0);
   else 
     err("You must specify a list of fields");
 
+  if (columnar && complement)
+    err("--columnar cannot be used with --complement");
+
   outfile = stdout;
 
   if (optind < argc) {
     while (optind < argc) {
       cut_file(argv[optind++]);
       if (reresolve) {
-        unresolve_fields();
+        field_specs_unresolve(&specs);
         first_record = 1;
       }
     }
@@ -569,6 +692,9 @@ main (int argc, char *argv[])
     cut_file(NULL);
   }
 
+  if (columnar)
+    write_row_group();
+
   exit(EXIT_SUCCESS);
 }
 
@@ -29,9 +29,41 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "version.h"
 #include "helper.h"
 
+#ifndef WITHOUT_THREADS
+#  include <pthread.h>
+#endif
+
 #define PROGRAM_NAME "csvfix"
 #define AUTHORS "Robert Gamble"
 
+/* Number of bytes read from the input at a time */
+#define BLOCK_SIZE (1024 * 1024)
+
+/* Buffered output is written once it grows past this size */
+#define OUTPUT_FLUSH_SIZE 65536
+
+/* Input encodings */
+enum encoding {
+  ENCODING_UTF8,
+  ENCODING_LATIN1,
+  ENCODING_UTF16,          /* Byte order given by the byte order mark */
+  ENCODING_UTF16LE,
+  ENCODING_UTF16BE
+};
+
+/* The state of one parse, with --threads each chunk gets its own */
+typedef struct fix_state {
+  struct proj_parser parser;  /* The parser calling cb1 and cb2 */
+  struct outbuf *out;         /* Where the fixed records are written */
+  size_t current_field;       /* The index of the next field in the record */
+  size_t record_start;        /* Offset in out of the current record */
+  int reencoding;             /* The parser is in the middle of a record
+                                 that is being re-encoded */
+  unsigned long padded;       /* Records padded with empty fields */
+  unsigned long truncated;    /* Records with fields dropped */
+  unsigned long rejected;     /* Records dropped */
+} fix_state;
+
 /* The name this program was called with */
 char *program_name;
 
@@ -59,8 +91,50 @@ char output_quote = CSV_QUOTE;
 /* The output quote argument */
 char *output_quote_name;
 
-/* The current_field */
-size_t current_field;
+/* Copy well formed records to the output as they are */
+int verbatim;
+
+/* The encoding of the input, it is converted to UTF-8 */
+enum encoding encoding = ENCODING_UTF8;
+
+/* The line ending written after each record */
+char *output_eol = "\n";
+
+/* The length of output_eol */
+size_t output_eol_len = 1;
+
+/* The number of threads to use */
+int threads = 1;
+
+/* Pad or cut every record to record_width fields */
+int normalize_width;
+
+/* The number of fields in a record, 0 until it is taken from the first
+   record */
+size_t record_width;
+
+/* Drop records with more than record_width fields instead of cutting them */
+int reject_long;
+
+/* Set until the record width is known, chunks are fixed one at a time
+   until then */
+int first_record;
+
+/* Records padded, truncated and rejected so far */
+unsigned long total_padded;
+unsigned long total_truncated;
+unsigned long total_rejected;
+
+#ifndef WITHOUT_THREADS
+/* Protects the totals above */
+pthread_mutex_t total_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* The output file */
+FILE *outfile;
+
+/* Output not yet written to outfile */
+struct outbuf output;
 
 static struct option const longopts[] =
 {
@@ -70,12 +144,32 @@ static struct option const longopts[] =
   {"help", no_argument, NULL, CHAR_MAX + 2},
   {"output-delimiter", required_argument, NULL,  CHAR_MAX + 3},
   {"output-quote", required_argument, NULL,  CHAR_MAX + 4},
+  {"verbatim", no_argument, NULL,  CHAR_MAX + 5},
+  {"threads", required_argument, NULL,  CHAR_MAX + 6},
+  {"encoding", required_argument, NULL,  CHAR_MAX + 7},
+  {"output-eol", required_argument, NULL,  CHAR_MAX + 8},
+  {"normalize-width", optional_argument, NULL,  CHAR_MAX + 9},
+  {"reject-long", no_argument, NULL,  CHAR_MAX + 10},
   {NULL, 0, NULL, 0}
 };
 
 void usage (int status);
-void cb1 (void *s, size_t i, void *outfile);
-void cb2 (int c, void *outfile);
+void cb1 (void *s, size_t i, void *data);
+void cb2 (int c, void *data);
+int is_blank (int c);
+size_t record_end (const unsigned char *s, size_t i, size_t len, int eof);
+size_t well_formed (const unsigned char *s, size_t len, int eof, int *incomplete,
+                    size_t *fields);
+size_t skip_bom (const unsigned char *s, size_t len);
+size_t decode (const unsigned char *s, size_t len, int eof, struct outbuf *text);
+size_t fix_block (fix_state *st, const unsigned char *data, size_t size, int eof);
+void init_state (fix_state *st, struct outbuf *out);
+void free_state (fix_state *st);
+void add_totals (fix_state *st);
+int write_output (struct outbuf *b);
+void flush_records (fix_state *st);
+void fix_chunk (struct chunk *c, void *arg);
+int finish_chunk (struct chunk *c, void *arg);
 
 void
 usage (int status)
@@ -91,10 +185,23 @@ properly formed CSV data to FILE2 or standard output\n\
   -d, --delimiter=DELIM         use DELIM instead of comma as delimiter\n\
   -q, --quote=QUOTE_CHAR        use QUOTE_CHAR instead of double quote as quote\n\
                                 character\n\
+      --encoding=ENC            convert the input from ENC to UTF-8, ENC is one\n\
+                                of utf-8 (the default), latin1, utf-16,\n\
+                                utf-16le or utf-16be, a byte order mark is\n\
+                                removed\n\
 ", program_name);
     printf("\
       --output-delimiter=DELIM  use DELIM as the output delimiter\n\
       --output-quote=QUOTE_CHAR use QUOTE_CHAR as the output quote character\n\
+      --output-eol=EOL          end records with EOL, one of lf (the default),\n\
+                                crlf or cr\n\
+      --verbatim                copy well formed records as they are and only\n\
+                                re-encode malformed ones\n\
+      --normalize-width[=N]     pad records with empty fields or cut them to N\n\
+                                fields, by default the width of the first record\n\
+      --reject-long             drop records with too many fields instead of\n\
+                                cutting them\n\
+      --threads=N               use N threads to fix the input\n\
       --version                 display version information and exit\n\
       --help                    display this help and exit\n\
 ");
@@ -103,28 +210,335 @@ properly formed CSV data to FILE2 or standard output\n\
 }
 
 void
-cb1 (void *s, size_t i, void *outfile)
+cb1 (void *s, size_t i, void *data)
+{
+  fix_state *st = data;
+
+  if (st->current_field == 0)
+    st->record_start = st->out->size;
+  if (record_width && st->current_field >= record_width) {
+    /* Fields past the record width are dropped */
+    st->current_field++;
+    return;
+  }
+  if (st->current_field != 0) outbuf_putc(st->out, output_delimiter);
+  outbuf_csv(st->out, i ? s : "", i, output_quote);
+  st->current_field++;
+}
+
+void
+cb2 (int c, void *data)
+{
+  fix_state *st = data;
+
+  if (normalize_width) {
+    if (record_width == 0) {
+      record_width = st->current_field;
+      first_record = 0;
+    } else if (st->current_field > record_width && reject_long) {
+      st->out->size = st->record_start;
+      st->rejected++;
+      st->current_field = 0;
+      return;
+    } else if (st->current_field > record_width) {
+      st->truncated++;
+    } else if (st->current_field < record_width) {
+      st->padded++;
+      for (; st->current_field < record_width; st->current_field++) {
+        outbuf_putc(st->out, output_delimiter);
+        outbuf_csv(st->out, "", 0, output_quote);
+      }
+    }
+  }
+  outbuf_write(st->out, output_eol, output_eol_len);
+  st->current_field = 0;
+}
+
+int
+is_blank (int c)
+{
+  /* The characters the parser strips around unquoted fields */
+  return c == CSV_SPACE || c == CSV_TAB;
+}
+
+size_t
+record_end (const unsigned char *s, size_t i, size_t len, int eof)
+{
+  /* Return the offset just past the line ending at s[i] if it is the output
+     line ending, 0 if it isn't and (size_t)-1 if more data is needed */
+  if (s[i] == '\n')
+    return output_eol[0] == '\n' ? i + 1 : 0;
+  if (output_eol[0] == '\n')
+    return 0;
+  if (i + 1 == len && !eof)
+    return (size_t)-1;
+  if (i + 1 < len && s[i + 1] == '\n')
+    return output_eol_len == 2 ? i + 2 : 0;
+  return output_eol_len == 1 && output_eol[0] == '\r' ? i + 1 : 0;
+}
+
+size_t
+well_formed (const unsigned char *s, size_t len, int eof, int *incomplete,
+             size_t *fields)
+{
+  /* Return the length of the record at the start of s, including its line
+     ending, if the parser would read it exactly as written and the record
+     is already properly formed, otherwise return 0.  *incomplete is set when
+     more data is needed to decide, *fields is set to the number of fields
+     of a well formed record. */
+  const unsigned char *q;
+  size_t i = 0, start, end;
+
+  *incomplete = 0;
+  *fields = 0;
+  while (i < len) {
+    if (s[i] == (unsigned char)quote) {
+      /* Quoted field, embedded quotes must be doubled */
+      for (i++;; i++) {
+        q = memchr(s + i, quote, len - i);
+        if (q == NULL)
+          goto more;
+        i = q - s + 1;
+        if (i == len)
+          goto more;
+        if (s[i] != (unsigned char)quote)
+          break;
+      }
+    } else {
+      /* Unquoted field, no quotes or surrounding blanks */
+      start = i;
+      i += memchr4(s + i, len - i, delimiter, quote, '\n', '\r');
+      if (i == len)
+        break;
+      if (s[i] == (unsigned char)quote)
+        return 0;
+      if (i > start && (is_blank(s[start]) || is_blank(s[i - 1])))
+        return 0;
+      if (i == start && *fields == 0 && s[i] != (unsigned char)delimiter)
+        return 0;  /* Blank lines are dropped */
+    }
+    (*fields)++;
+    if (s[i] == (unsigned char)delimiter) {
+      i++;
+    } else if (s[i] == '\n' || s[i] == '\r') {
+      if ((end = record_end(s, i, len, eof)) == (size_t)-1)
+        break;
+      return end;
+    } else
+      return 0;
+  }
+
+more:
+  *incomplete = 1;
+  return 0;
+}
+
+size_t
+fix_block (fix_state *st, const unsigned char *data, size_t size, int eof)
+{
+  /* Copy runs of well formed records in data to the output and re-encode
+     the rest, returning the number of bytes consumed.  A trailing record
+     which can't be checked yet is left for the next block unless eof is
+     set. */
+  size_t pos = 0, run = 0, len, i, fields;
+  int incomplete;
+
+  while (pos < size) {
+    if (!st->reencoding) {
+      len = well_formed(data + pos, size - pos, eof, &incomplete, &fields);
+      if (len && normalize_width) {
+        /* Only records of the right width can be copied */
+        if (record_width == 0) {
+          record_width = fields;
+          first_record = 0;
+        } else if (fields != record_width)
+          len = 0;
+      }
+      if (len) {
+        pos += len;
+        continue;
+      }
+      if (incomplete && !eof)
+        break;
+      outbuf_write(st->out, data + run, pos - run);
+      run = pos;
+    }
+
+    /* Feed the parser a line at a time until it ends a record at the end
+       of a line, the records after that may be copied again.  A record can
+       only end at a line ending, which is kept in one piece. */
+    len = size - pos;
+    if (verbatim && (i = memchr4(data + pos, len, '\n', '\r', '\n', '\r')) < len) {
+      if (data[pos + i] == '\r' && i + 1 == len && !eof)
+        break;
+      if (data[pos + i] == '\r' && i + 1 < len && data[pos + i + 1] == '\n')
+        i++;
+      len = i + 1;
+    }
+    if (proj_parse(&st->parser, data + pos, len, cb1, cb2, st) != len)
+      return (size_t)-1;
+    st->reencoding = !verbatim || st->parser.row_pos == 0;
+    pos += len;
+    run = pos;
+  }
+
+  outbuf_write(st->out, data + run, pos - run);
+  return pos;
+}
+
+size_t
+skip_bom (const unsigned char *s, size_t len)
+{
+  /* Return the length of the byte order mark at the start of the input,
+     for utf-16 it also picks the byte order, big endian without a mark */
+  switch (encoding) {
+    case ENCODING_UTF8:
+      return len >= 3 && !memcmp(s, "\xEF\xBB\xBF", 3) ? 3 : 0;
+
+    case ENCODING_UTF16:
+      encoding = len >= 2 && !memcmp(s, "\xFF\xFE", 2) ? ENCODING_UTF16LE : ENCODING_UTF16BE;
+      /* Fall through */
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE:
+      if (len >= 2 && !memcmp(s, encoding == ENCODING_UTF16LE ? "\xFF\xFE" : "\xFE\xFF", 2))
+        return 2;
+      return 0;
+
+    default:
+      return 0;
+  }
+}
+
+size_t
+decode (const unsigned char *s, size_t len, int eof, struct outbuf *text)
+{
+  /* Append the input s to text as UTF-8, returning the number of bytes
+     used.  A partial character is left for the next call unless eof is
+     set. */
+  switch (encoding) {
+    case ENCODING_LATIN1:
+      return latin1_to_utf8(s, len, text);
+
+    case ENCODING_UTF16LE:
+    case ENCODING_UTF16BE:
+      return utf16_to_utf8(s, len, encoding == ENCODING_UTF16BE, eof, text);
+
+    default:
+      outbuf_write(text, s, len);
+      return len;
+  }
+}
+
+void
+init_state (fix_state *st, struct outbuf *out)
+{
+  if (proj_init(&st->parser, 0) != 0)
+    err("Failed to initialize csv parser");
+
+  proj_set_delim(&st->parser, delimiter);
+  proj_set_quote(&st->parser, quote);
+  st->out = out;
+  st->current_field = 0;
+  st->record_start = 0;
+  st->reencoding = !verbatim;
+  st->padded = st->truncated = st->rejected = 0;
+}
+
+void
+free_state (fix_state *st)
+{
+  proj_free(&st->parser);
+}
+
+void
+add_totals (fix_state *st)
+{
+  /* Add the counts of a parse to the totals */
+#ifndef WITHOUT_THREADS
+  pthread_mutex_lock(&total_lock);
+#endif
+  total_padded += st->padded;
+  total_truncated += st->truncated;
+  total_rejected += st->rejected;
+#ifndef WITHOUT_THREADS
+  pthread_mutex_unlock(&total_lock);
+#endif
+}
+
+int
+write_output (struct outbuf *b)
+{
+  /* Write buffered output to outfile */
+  return outbuf_flush(b, outfile);
+}
+
+void
+flush_records (fix_state *st)
 {
-  if (current_field != 0) fputc(output_delimiter,(FILE *)outfile);
-  csv_fwrite2((FILE *)outfile, i ? s : "", i, output_quote);
-  current_field++;
+  /* Write the records fixed so far, a record still being fixed is kept as
+     it may yet be rejected */
+  struct outbuf *b = st->out;
+  size_t keep = st->current_field ? b->size - st->record_start : 0;
+
+  fwrite(b->data, 1, b->size - keep, outfile);
+  memmove(b->data, b->data + b->size - keep, keep);
+  b->size = keep;
+  st->record_start = 0;
 }
 
 void
-cb2 (int c, void *outfile)
+fix_chunk (struct chunk *c, void *arg)
 {
-  fputc('\n', (FILE *)outfile);
-  current_field = 0;
+  /* Fix the records in a chunk, called from the worker threads */
+  fix_state st;
+  struct outbuf text;
+  const unsigned char *data = (unsigned char *)c->data;
+  size_t size = c->size;
+
+  init_state(&st, &c->out);
+  outbuf_init(&text);
+  if (encoding != ENCODING_UTF8) {
+    decode(data, size, 1, &text);
+    data = (unsigned char *)text.data;
+    size = text.size;
+  }
+
+  /* Chunks never end inside a line ending, so every chunk starts where the
+     sequential run would be checking records again */
+  if (fix_block(&st, data, size, 1) != size
+      || (c->last && proj_fini(&st.parser, cb1, cb2, &st) != 0))
+    c->status = proj_error(&st.parser);
+
+  add_totals(&st);
+  outbuf_free(&text);
+  free_state(&st);
+}
+
+int
+finish_chunk (struct chunk *c, void *arg)
+{
+  /* Write the output of a chunk, stop at the first error */
+  write_output(&c->out);
+  if (c->status) {
+    fprintf(stderr, "Error parsing file: %s\n", csv_strerror(c->status));
+    return 1;
+  }
+  return 0;
 }
 
 int
 main (int argc, char *argv[])
 {
-  char buf[1024];
-  size_t i;
-  struct csv_parser p;
-  FILE *infile, *outfile;
-  int optc;
+  unsigned char *raw;
+  size_t i, raw_size = 0, used;
+#ifndef WITHOUT_THREADS
+  unsigned char bom[3];
+  long start;
+#endif
+  struct outbuf text;
+  fix_state st;
+  FILE *infile;
+  int optc, ch, first = 1;
 
   program_name = argv[0];
 
@@ -164,6 +578,62 @@ main (int argc, char *argv[])
           output_quote = output_quote_name[0];
         break;
 
+      case CHAR_MAX + 5:
+        /* --verbatim */
+        verbatim = 1;
+        break;
+
+      case CHAR_MAX + 6:
+        /* --threads */
+        if (!Is_numeric(optarg) || (threads = atoi(optarg)) < 1)
+          err("the number of threads must be a positive number");
+#ifdef WITHOUT_THREADS
+        if (threads > 1)
+          err("not compiled with thread support");
+#endif
+        break;
+
+      case CHAR_MAX + 7:
+        /* --encoding */
+        if (!strcmp(optarg, "utf-8") || !strcmp(optarg, "utf8"))
+          encoding = ENCODING_UTF8;
+        else if (!strcmp(optarg, "latin1") || !strcmp(optarg, "iso-8859-1"))
+          encoding = ENCODING_LATIN1;
+        else if (!strcmp(optarg, "utf-16") || !strcmp(optarg, "utf16"))
+          encoding = ENCODING_UTF16;
+        else if (!strcmp(optarg, "utf-16le") || !strcmp(optarg, "utf16le"))
+          encoding = ENCODING_UTF16LE;
+        else if (!strcmp(optarg, "utf-16be") || !strcmp(optarg, "utf16be"))
+          encoding = ENCODING_UTF16BE;
+        else
+          err("the encoding must be one of utf-8, latin1, utf-16, utf-16le or utf-16be");
+        break;
+
+      case CHAR_MAX + 8:
+        /* --output-eol */
+        if (!strcmp(optarg, "lf"))
+          output_eol = "\n";
+        else if (!strcmp(optarg, "crlf"))
+          output_eol = "\r\n";
+        else if (!strcmp(optarg, "cr"))
+          output_eol = "\r";
+        else
+          err("the line ending must be one of lf, crlf or cr");
+        output_eol_len = strlen(output_eol);
+        break;
+
+      case CHAR_MAX + 9:
+        /* --normalize-width */
+        normalize_width = 1;
+        if (optarg && (!Is_numeric(optarg) || (record_width = strtoul(optarg, NULL, 10)) == 0))
+          err("the record width must be a positive number");
+        break;
+
+      case CHAR_MAX + 10:
+        /* --reject-long */
+        reject_long = 1;
+        break;
+
       case CHAR_MAX + 1:
         /* --version */
         print_version(PROGRAM_NAME);
@@ -178,9 +648,24 @@ main (int argc, char *argv[])
         usage(EXIT_FAILURE);
     }
 
-  csv_init(&p, 0);
-  csv_set_delim(&p, delimiter);
-  csv_set_quote(&p, quote);
+  if (encoding != ENCODING_UTF8
+      && ((unsigned char)delimiter >= 0x80 || (unsigned char)quote >= 0x80))
+    err("the delimiter and quote must be ASCII characters to convert the input");
+
+  if (reject_long && !normalize_width)
+    err("--reject-long can only be used with --normalize-width");
+
+  /* The width of the first record must be known before chunks are fixed
+     concurrently */
+  first_record = normalize_width && record_width == 0;
+
+  if (threads > 1 && encoding != ENCODING_UTF8 && encoding != ENCODING_LATIN1)
+    err("--threads can't be used with UTF-16 input");
+
+  /* Records can only be copied when the output dialect is the input one */
+  if (delimiter != output_delimiter || quote != output_quote
+      || is_blank(delimiter) || is_blank(quote))
+    verbatim = 0;
 
   infile = stdin;
   outfile = stdout;
@@ -207,18 +692,91 @@ main (int argc, char *argv[])
     }
   }
 
-  while ((i=fread(buf, 1, 1024, infile)) > 0) {
-    if (csv_parse(&p, buf, i, cb1, cb2, outfile) != i) {
-      fprintf(stderr, "Error parsing file: %s\n", csv_strerror(csv_error(&p)));
+  outbuf_init(&text);
+
+#ifndef WITHOUT_THREADS
+  if (threads > 1 && encoding == ENCODING_UTF8) {
+    /* The chunks must be found after the byte order mark is removed.  One
+       byte can always be pushed back, more only if the input can be read
+       again. */
+    start = ftell(infile);
+    if ((ch = getc(infile)) != 0xEF) {
+      if (ch != EOF)
+        ungetc(ch, infile);
+    } else {
+      bom[0] = ch;
+      i = 1 + fread(bom + 1, 1, 2, infile);
+      if (skip_bom(bom, i) != 3 && (start == -1 || fseek(infile, start, SEEK_SET) != 0)) {
+        /* The input can't be read again, fix it with one thread */
+        outbuf_write(&text, bom, i);
+        threads = 1;
+      }
+    }
+  }
+
+  if (threads > 1) {
+    if (parallel_chunks(infile, threads, delimiter, quote, fix_chunk, finish_chunk, NULL, &first_record) != 0) {
       fclose(infile);
       fclose(outfile);
-      if (argc - optind == 2) remove(argv[optind]);
       exit(EXIT_FAILURE);
     }
+    goto done;
   }
+#endif
+
+  outbuf_init(&output);
+  init_state(&st, &output);
+  raw = xmalloc(BLOCK_SIZE);
+  do {
+    /* A record not yet checked is kept in front of the next block, UTF-8
+       input is read straight into it */
+    if (encoding == ENCODING_UTF8) {
+      outbuf_reserve(&text, BLOCK_SIZE);
+      i = fread(text.data + text.size, 1, BLOCK_SIZE, infile);
+      text.size += i;
+      if (first) {
+        used = skip_bom((unsigned char *)text.data, text.size);
+        memmove(text.data, text.data + used, text.size - used);
+        text.size -= used;
+      }
+    } else {
+      i = fread(raw + raw_size, 1, BLOCK_SIZE - raw_size, infile);
+      raw_size += i;
+      used = first ? skip_bom(raw, raw_size) : 0;
+      used += decode(raw + used, raw_size - used, i == 0, &text);
+      memmove(raw, raw + used, raw_size - used);
+      raw_size -= used;
+    }
+    first = 0;
 
-  csv_fini(&p, cb1, cb2, outfile);
-  csv_free(&p);
+    used = fix_block(&st, (unsigned char *)text.data, text.size, i == 0);
+    if (used == (size_t)-1) {
+      write_output(&output);
+      fprintf(stderr, "Error parsing file: %s\n", csv_strerror(proj_error(&st.parser)));
+      fclose(infile);
+      fclose(outfile);
+      if (argc - optind == 2) remove(argv[optind]);
+      exit(EXIT_FAILURE);
+    }
+    memmove(text.data, text.data + used, text.size - used);
+    text.size -= used;
+    if (output.size >= OUTPUT_FLUSH_SIZE)
+      flush_records(&st);
+  } while (i > 0);
+
+  proj_fini(&st.parser, cb1, cb2, &st);
+  write_output(&output);
+  add_totals(&st);
+  free_state(&st);
+  outbuf_free(&text);
+  free(raw);
+
+#ifndef WITHOUT_THREADS
+done:
+#endif
+  if (normalize_width)
+    fprintf(stderr, "%lu records padded, %lu truncated, %lu rejected\n",
+            total_padded, total_truncated, total_rejected);
 
   if (ferror(infile)) {
     fprintf(stderr, "Error reading from input file");
@@ -48,20 +48,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define PROGRAM_NAME "csvgrep"
 #define AUTHORS "Robert Gamble"
 
-
-typedef struct entry {
-  size_t size;       /* The size of the current entry */
-  size_t alloc_size; /* The size allocated for data */
-  char *data;        /* The field data */
-} entry;
-
-typedef struct field_spec {
-  char *start_name;
-  char *stop_name;
-  size_t start_value;
-  size_t stop_value;
-} field_spec;
-
 enum { NONE, FIXED, EXTENDED, PCRE } match_type;
 
 static struct option const longopts[] = 
@@ -106,20 +92,11 @@ int print_matching_filenames;
 /* print only filenames that don't match if set */
 int print_nonmatching_filenames;
 
-/* The number of fields waiting for name resolution */
-int unresolved_fields;
-
-/* Pointer to the array of entries */
-entry *entry_array;
+/* The fields of the current record */
+struct record entries;
 
-/* Pointer to the array of field specifications */
-field_spec *field_spec_array;
-
-/* Size of the field_spec_array */
-size_t field_spec_size;
-
-/* The current size of the entry array */
-size_t entry_array_size;
+/* The field specifications */
+struct field_specs specs;
 
 /* The name this program was called with */
 char *program_name;
@@ -200,177 +177,65 @@ int print_header;
 /* do not print CSV header if set */
 int no_print_header;
 
+/* Flags for the fields the parser needs to pass to cb1 */
+unsigned char *column_array;
+
+/* The number of elements in column_array */
+size_t column_array_size;
+
 void print_unresolved_fields(void);
-void unresolve_fields(void);
-void process_field_specs(char *f);
-void add_field_spec(char *start, char *stop, size_t start_value, size_t stop_value);
-void field_spec_cb1(void *s, size_t len, void *data);
-void field_spec_cb2(int c, void *data);
 void print_record(void);
 void usage(int status);
 int matches_pattern (char *pattern, char *data, size_t len);
 void cb1 (void *data, size_t len, void *vp);
 void cb2 (int c, void *vp);
 void grep_file(char *filename);
+void select_columns(struct proj_parser *p);
 void cleanup(void);
 
 void
 cleanup(void)
 {
-  /* Free memory for entry_array and field_spec_array */
+  /* Free memory for entries and the field specs */
   /* Only to be called once by atexit! */
-  size_t i;
-  for (i = 0; i < entry_array_size; i++)
-    free(entry_array[i].data);
-  free(entry_array);
-
-  for (i = 0; i < field_spec_size; i++) {
-    free(field_spec_array[i].start_name);
-    free(field_spec_array[i].stop_name);
-  }
-  free(field_spec_array);
+  record_free(&entries);
+
+  field_specs_free(&specs);
+  free(column_array);
 }
 
 void
 print_unresolved_fields(void)
 {
   /* Print the first unresolved field name found and exit */
-  size_t i;
-  fprintf(stderr, "Unable to resolve the field ");
-  for (i = 0; i < field_spec_size; i++) {
-    if (field_spec_array[i].start_name != NULL && field_spec_array[i].start_value == 0) {
-      fprintf(stderr, "'%s' ", field_spec_array[i].start_name);
-      break;
-    }
-    if (field_spec_array[i].stop_name != NULL && field_spec_array[i].stop_value == 0) {
-      fprintf(stderr, "'%s' ", field_spec_array[i].stop_name);
-      break;
-    }
-  }
+  fprintf(stderr, "Unable to resolve the field '%s' ", field_specs_unresolved_name(&specs));
   puts("");
   exit(EXIT_FAILURE);
 }
 
 void
-unresolve_fields(void)
+select_columns(struct proj_parser *p)
 {
-  /* Unresolve all field thats originally needed resolving for -? option */
-  size_t i;
-  for (i = 0; i < field_spec_size; i++) {
-    if (field_spec_array[i].start_name != NULL) {
-      field_spec_array[i].start_value = 0;
-      unresolved_fields++;
-    }
-    if (field_spec_array[i].stop_name != NULL) {
-      field_spec_array[i].stop_value = 0;
-      unresolved_fields++;
-    }
-  }
-}
-
-void
-process_field_specs(char *f)
-{
-  struct csv_parser p;
-  size_t len = strlen(f);
-  if (csv_init(&p, CSV_STRICT|CSV_STRICT_FINI))
-    err("Failed to initialize csv parser");
-
-  if (csv_parse(&p, f, len, field_spec_cb1, field_spec_cb2, NULL) != len)
-    err("Invalid field spec");
-
-  if (csv_fini(&p, field_spec_cb1, field_spec_cb2, NULL))
-    err("Invalid field spec");
-
-  if (field_spec_size == 0)
-    err("Field list cannot be empty");
-}
-
-void
-add_field_spec(char *start, char *stop, size_t start_value, size_t stop_value)
-{
-  field_spec *ptr;
-  field_spec_array = xrealloc(field_spec_array, (field_spec_size+1) * sizeof(field_spec));
-  field_spec_size++;
-  ptr = &field_spec_array[field_spec_size-1];
-  ptr->start_name = start;
-  ptr->stop_name = stop;
-  ptr->start_value = start_value;
-  ptr->stop_value = stop_value;
-}
+  /* When matching records are not printed only the searched fields are
+     needed, tell the parser once all field names are resolved */
+  size_t i, j;
 
-void
-field_spec_cb1(void *s, size_t len, void *data)
-{
-  size_t left_size = 0, right_size = 0;
-  long unsigned left_value = 0, right_value = 0;
-  char *left = NULL, *right = NULL;
-  char *ptr, *field;
-  int left_ended = 0;
-
-  left = ptr = field = Strndup(s, len);
-
-  while (*ptr) {
-    if (*ptr == '-') {
-      if (left_ended || left_size == 0)
-        err("Invalid field spec");
-      left = Strndup(s, left_size);
-      if (Is_numeric(left)) {
-        left_value = strtoul(left, NULL, 10);
-        if (left_value == 0)
-          err("0 is not a valid field index");
-      } else
-        unresolved_fields++;
-      left_ended = 1;
-      right = ++ptr;
-    } else {
-      if (left_ended) {
-        right_size++;
-      } else {
-        left_size++;
-      }
-      ptr++;
-    }
-  }
+  if (specs.unresolved
+      || !(print_count || print_matching_filenames || print_nonmatching_filenames))
+    return;
 
-  if (left_ended) {
-    right = Strndup(right, right_size);
-    if (Is_numeric(right)) {
-      right_value = strtoul(right, NULL, 10);
-      if (right_value == 0)
-        err("0 is not a valid field index");
-    } else
-      unresolved_fields++;
-  } else {
-    left = Strndup(s, left_size);
-    if (Is_numeric(left)) {
-      left_value = strtoul(left, NULL, 10);
-      if (left_value == 0)
-        err("0 is not a valid field index");
-    } else {
-      right = Strndup(left, left_size);
-      unresolved_fields+=2;
-    }
-    right_value = left_value;
-  }
-  if (left_value != 0) {
-    free(left);
-    left = NULL;
-  }
-  if (right_value != 0) {
-    free(right);
-    right = NULL;
-  }
+  column_array_size = 0;
+  for (i = 0; i < specs.count; i++)
+    if (specs.specs[i].stop_value > column_array_size)
+      column_array_size = specs.specs[i].stop_value;
 
-  add_field_spec(left, right, left_value, right_value);
-}
+  column_array = xrealloc(column_array, column_array_size ? column_array_size : 1);
+  memset(column_array, 0, column_array_size);
+  for (i = 0; i < specs.count; i++)
+    for (j = specs.specs[i].start_value; j <= specs.specs[i].stop_value; j++)
+      column_array[j-1] = 1;
 
-void
-field_spec_cb2(int c, void *data)
-{
-  /* Field spec should not contain newlines */
-  if (c >= 0)
-    err("Invalid field spec");
+  proj_set_columns(p, column_array, column_array_size);
 }
 
 void
@@ -392,9 +257,8 @@ print_record(void)
     else
       fputc(delimiter, stdout); 
 
-    csv_fwrite2(stdout,
-                entry_array[idx].size ? entry_array[idx].data : "",
-                entry_array[idx].size, quote);
+    csv_fwrite2(stdout, record_field(&entries, idx),
+                record_field_size(&entries, idx), quote);
     idx++;
   }
   fputc('\n', stdout);
@@ -485,47 +349,13 @@ matches_pattern (char *pattern, char *data, size_t len)
 void
 cb1 (void *data, size_t len, void *vp)
 {
-  size_t i = 0;
-  if (unresolved_fields) {
-    /* Print CSV header if non-numeric fields provided and --no-print-header
-     * not specified */
-    if (no_print_header == 0) print_header = 1;
-    if (first_record) {
-      while (i < field_spec_size) {
-        if (field_spec_array[i].start_value == 0
-            && strlen(field_spec_array[i].start_name) == len
-            && !strncmp(field_spec_array[i].start_name, data, len)) {
-              field_spec_array[i].start_value = current_field+1;
-              unresolved_fields--;
-        }
-        if (field_spec_array[i].stop_value == 0
-            && strlen(field_spec_array[i].stop_name) == len
-            && !strncmp(field_spec_array[i].stop_name, data, len)) {
-              field_spec_array[i].stop_value = current_field+1;
-              unresolved_fields--;
-        }
-        i++;
-      }
-    }
-  }
-
-  /* Check for element to hold entry, create one if needed */
-  if (current_field >= entry_array_size) {
-    entry_array = xrealloc(entry_array, (entry_array_size+1) * sizeof(struct entry));
-    entry_array_size++;
-    entry_array[entry_array_size-1].data = NULL;
-    entry_array[entry_array_size-1].size = 0;
-    entry_array[entry_array_size-1].alloc_size = 0;
-  }
-
-  /* Element exists at this point, make sure it is large enough */
-  if (entry_array[current_field].alloc_size < len) {
-    entry_array[current_field].data = xrealloc(entry_array[current_field].data, len);
-    entry_array[current_field].alloc_size = len;
-  }
+  /* Print CSV header if non-numeric fields provided and --no-print-header
+   * not specified, the names are resolved at the end of the record */
+  if (specs.unresolved && no_print_header == 0)
+    print_header = 1;
 
-  memcpy(entry_array[current_field].data, data, len);
-  entry_array[current_field].size = len;
+  /* Fields that were not selected are stored empty, data is NULL */
+  record_add(&entries, data, len);
 
   current_field++;
 }
@@ -537,26 +367,31 @@ cb2 (int c, void *vp)
 
   if (first_record && current_field > 0) {
     first_record = 0;
-    if (print_header && !unresolved_fields) {
+    if (specs.unresolved)
+      field_specs_resolve(&specs, &entries);
+    /* vp is the parser, see grep_file() */
+    select_columns(vp);
+    if (print_header && !specs.unresolved) {
       print_record();
       goto end;
     }
-    if (no_print_header && !unresolved_fields) {
+    if (no_print_header && !specs.unresolved) {
       goto end;
     }
   }
 
-  if (unresolved_fields && !first_record)
+  if (specs.unresolved && !first_record)
     print_unresolved_fields();
 
   if (cur_matches && (print_matching_filenames || print_nonmatching_filenames))
     goto end;
 
   for (i = 1; i <= current_field && !match; i++) {
-    for (j = 0; j < field_spec_size && !match; j++) {
-      if (i >= field_spec_array[j].start_value 
-          && i <= field_spec_array[j].stop_value
-          && matches_pattern(pattern, entry_array[i-1].data, entry_array[i-1].size))
+    for (j = 0; j < specs.count && !match; j++) {
+      if (i >= specs.specs[j].start_value 
+          && i <= specs.specs[j].stop_value
+          && matches_pattern(pattern, record_field(&entries, i-1),
+                             record_field_size(&entries, i-1)))
         match = 1;
     }
   }
@@ -574,6 +409,7 @@ cb2 (int c, void *vp)
 end:
   match = 0;
   current_field = 0;
+  record_reset(&entries);
   current_record++;
 }
 
@@ -581,17 +417,18 @@ void
 grep_file(char *filename)
 {
   FILE *fp;
-  struct csv_parser p;
+  struct proj_parser p;
   char buf[1024];
   size_t bytes_read;
 
   cur_matches = 0;
 
-  if (csv_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+  if (proj_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
     err("Failed to initialize csv parser");
 
-  csv_set_delim(&p, delimiter);
-  csv_set_quote(&p, quote);
+  proj_set_delim(&p, delimiter);
+  proj_set_quote(&p, quote);
+  select_columns(&p);
 
   if (filename == NULL || !strcmp(filename, "-")) {
     fp = stdin;
@@ -603,27 +440,27 @@ grep_file(char *filename)
 
   if (!fp) {
     fprintf(stderr, "Failed to open %s: %s\n", filename, strerror(errno));
-    csv_free(&p);
+    proj_free(&p);
     return;
   }
 
   while ((bytes_read=fread(buf, 1, 1024, fp)) > 0) {
-    if (csv_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
-      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-      csv_free(&p);
+    if (proj_parse(&p, buf, bytes_read, cb1, cb2, &p) != bytes_read) {
+      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+      proj_free(&p);
       fclose(fp);
       return;
     }
   }
 
-  if (csv_fini(&p, cb1, cb2, NULL) != 0) {
-    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(csv_error(&p)));
-    csv_free(&p);
+  if (proj_fini(&p, cb1, cb2, &p) != 0) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+    proj_free(&p);
     fclose(fp);
     return;
   }
 
-  csv_free(&p);
+  proj_free(&p);
 
   if (ferror(fp)) {
     fprintf(stderr, "Error reading file %s\n", filename);
@@ -766,7 +603,7 @@ main (int argc, char *argv[])
   if (!field_spec_arg)
     usage(EXIT_FAILURE);
 
-  process_field_specs(field_spec_arg);
+  field_specs_parse(&specs, field_spec_arg, 1);
 
   pattern = argv[optind++];
   if (!pattern)
@@ -809,7 +646,7 @@ main (int argc, char *argv[])
     while (optind < argc) {
       grep_file(argv[optind++]);
       if (reresolve) {
-        unresolve_fields();
+        field_specs_unresolve(&specs);
         first_record = 1;
       }
     }
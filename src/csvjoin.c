@@ -0,0 +1,792 @@
+/*
+csvjoin - Join the records of two CSV files on the values of the
+          specified fields
+
+Copyright (C) 2007  Robert Gamble
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <ctype.h>
+#include "libcsv/csv.h"
+#include "version.h"
+#include "helper.h"
+
+#define PROGRAM_NAME "csvjoin"
+#define AUTHORS "Robert Gamble"
+
+/* Output is written once this much of it is buffered */
+#define OUTPUT_FLUSH_SIZE 65536
+
+/* The records in temporary files are items made of the key hash, the
+   record number, the length of the key and the length of the key and
+   the record, followed by the key and the record.  Results are items
+   made of the phase, the record number, 0 and the length of the joined
+   record, see emit(). */
+#define ITEM_HEAD 4
+
+/* The two inputs */
+#define LEFT 0
+#define RIGHT 1
+
+/* One of the input files */
+typedef struct side {
+  char *file_name;
+  FILE *fp;
+  long size;                /* The size of the file, LONG_MAX if unknown */
+  struct field_specs specs; /* The key fields as given */
+  size_t *key_fields;       /* The numbers of the key fields, in order */
+  size_t key_field_count;
+  int first_record;         /* Set until the first record was read */
+  size_t width;             /* The number of fields of the first record */
+  struct outbuf header;     /* The header record as printed, without the
+                               newline */
+  struct record entries;    /* The fields of the current record */
+  uint64_t current_record;  /* The number of the current record */
+} side;
+
+/* A record of the build side, see add_build() */
+typedef struct entry {
+  uint64_t hash;            /* hash_bytes() of the key */
+  uint64_t seq;             /* The record number */
+  size_t data;              /* The key followed by the record in data */
+  size_t key_len;
+  size_t rec_len;
+  size_t next;              /* Index plus one of the next entry with the
+                               same key, 0 if none */
+  size_t last;              /* Index plus one of the last entry with the
+                               key, only kept in the first one */
+  int matched;              /* Set once a probe record matched */
+} entry;
+
+/* The hash table of the build side, or of a partition of it */
+typedef struct join_table {
+  entry *entries;           /* The entries in input order */
+  size_t entry_count;
+  size_t entry_alloc;
+  size_t key_count;         /* The number of distinct keys */
+  size_t *table;            /* Open addressed table of the index plus one
+                               of the first entry with each key */
+  size_t table_size;        /* The number of slots, a power of 2 */
+  struct outbuf data;       /* The keys and records of the entries */
+  int level;                /* The number of times the input was split */
+  int split;                /* Set once the input was split */
+  FILE *build_parts[PARTITIONS];
+  FILE *probe_parts[PARTITIONS];
+  FILE *out;                /* Where results go, NULL to print them */
+} join_table;
+
+static struct option const longopts[] =
+{
+  {"delimiter", required_argument, NULL, 'd'},
+  {"fields", required_argument, NULL, 'f'},
+  {"left-fields", required_argument, NULL, '1'},
+  {"right-fields", required_argument, NULL, '2'},
+  {"header", no_argument, NULL, 'h'},
+  {"join", required_argument, NULL, 'j'},
+  {"quote", required_argument, NULL, 'q'},
+  {"strict", no_argument, NULL, 's'},
+  {"version", no_argument, NULL, CHAR_MAX + 1},
+  {"help", no_argument, NULL, CHAR_MAX + 2},
+  {"memory", required_argument, NULL, CHAR_MAX + 3},
+  {NULL, 0, NULL, 0}
+};
+
+/* The name this program was called with */
+char *program_name;
+
+/* The delimiter character */
+char delimiter = CSV_COMMA;
+
+/* The quote character */
+char quote = CSV_QUOTE;
+
+/* Enforce strict CSV? */
+int strict;
+
+/* If set, the first record of each file is a header */
+int write_header;
+
+/* Set once the header was printed */
+int header_printed;
+
+/* Which records are printed */
+enum { JOIN_INNER, JOIN_LEFT, JOIN_ANTI } join_type;
+
+/* The most memory to use for the build side */
+size_t memory_limit = 64 * 1024 * 1024;
+
+/* The two input files */
+side sides[2];
+
+/* The side the hash table is built from, the smaller one */
+int build_side;
+
+/* The hash table of the build side */
+join_table input_table;
+
+/* The key fields of the current record as hashed */
+struct outbuf key_bytes;
+
+/* The current record, its key followed by its fields as printed */
+struct outbuf item_data;
+
+/* The current output record */
+struct outbuf joined;
+
+/* Output waiting to be written */
+struct outbuf output;
+
+void make_key_fields(side *sd);
+void write_output(void);
+void print_header(void);
+void emit(FILE *out, uint64_t phase, uint64_t seq, const char *left, size_t left_len,
+          const char *right, size_t right_len);
+void join_table_init(join_table *t, int level, FILE *out);
+void join_table_free(join_table *t);
+size_t join_table_memory(join_table *t);
+void grow_table(join_table *t);
+size_t *find_slot(join_table *t, uint64_t hash, const char *key, size_t key_len);
+void add_build(join_table *t, const uint64_t *head, const char *data);
+void add_probe(join_table *t, const uint64_t *head, const char *data);
+void split_table(join_table *t);
+void finish_table(join_table *t);
+void print_result(const uint64_t *head, const char *data, size_t len);
+void cb1 (void *data, size_t len, void *vp);
+void cb2 (int c, void *vp);
+void read_side(side *sd);
+long file_size(FILE *fp);
+void usage (int status);
+void cleanup(void);
+
+
+void
+cleanup(void)
+{
+  /* Free memory, temporary files are removed when closed */
+  size_t i;
+
+  for (i = 0; i < 2; i++) {
+    field_specs_free(&sides[i].specs);
+    free(sides[i].key_fields);
+    outbuf_free(&sides[i].header);
+    record_free(&sides[i].entries);
+  }
+  join_table_free(&input_table);
+  outbuf_free(&key_bytes);
+  outbuf_free(&item_data);
+  outbuf_free(&joined);
+  outbuf_free(&output);
+}
+
+void
+usage (int status)
+{
+  if (status != EXIT_SUCCESS)
+    fprintf (stderr, "Try `%s --help for more information.\n", program_name);
+  else {
+    printf("\
+Usage: %s -f FIELD_LIST [OPTIONS]... FILE1 FILE2\n\
+Join the records of two CSV files with the same values in the specified\n\
+fields, either file may be - for standard input\n\
+\n\
+  -d, --delimiter=DELIM_CHAR   use DELIM_CHAR instead of comma as delimiter\n\
+  -f, --fields=FIELD_LIST      the field names or numbers to join on\n\
+  -1, --left-fields=FIELD_LIST the fields of FILE1 to join on, instead of -f\n\
+  -2, --right-fields=FIELD_LIST\n\
+                               the fields of FILE2 to join on, instead of -f\n\
+", program_name);
+    printf("\
+  -h, --header                 the first record of each file is a header, print\n\
+                               them joined first\n\
+  -j, --join=inner|left|anti   print the joined records with matching values,\n\
+                               also the records of FILE1 without any, or only\n\
+                               the records of FILE1 without any\n\
+  -q, --quote=QUOTE_CHAR       use QUOTE_CHAR instead of double quote as quote\n\
+                               character\n\
+  -s, --strict                 enforce strict mode, mal-formed CSV files will\n\
+                               cause an error\n\
+");
+    printf("\
+      --memory=SIZE            keep at most SIZE bytes of the smaller file in\n\
+                               memory, using temporary files for the rest\n\
+      --version                display version information and exit\n\
+      --help                   display this help and exit\n\
+");
+  }
+  exit(status);
+}
+
+void
+make_key_fields(side *sd)
+{
+  /* Expand the resolved field specs into the list of key fields, both
+     files need the same number of them */
+  side *other = &sides[sd == &sides[LEFT] ? RIGHT : LEFT];
+
+  sd->key_fields = field_specs_fields(&sd->specs, &sd->key_field_count);
+
+  if (other->key_field_count && other->key_field_count != sd->key_field_count)
+    err("Both files must be joined on the same number of fields");
+}
+
+void
+write_output(void)
+{
+  if (outbuf_flush(&output, stdout) != 0)
+    err("Failed to write output");
+}
+
+void
+print_header(void)
+{
+  /* Print the headers of both files joined, once, nothing if the headers
+     printed are missing because the files are empty */
+  if (!write_header || header_printed)
+    return;
+  header_printed = 1;
+  if (sides[LEFT].header.size == 0
+      && (join_type == JOIN_ANTI || sides[RIGHT].header.size == 0))
+    return;
+  emit(NULL, 0, 0, sides[LEFT].header.data, sides[LEFT].header.size,
+       sides[RIGHT].header.data, sides[RIGHT].header.size);
+}
+
+void
+emit(FILE *out, uint64_t phase, uint64_t seq, const char *left, size_t left_len,
+     const char *right, size_t right_len)
+{
+  /* Print the fields of a left record followed by those of the right one,
+     with -j left right is NULL if there is none and the right fields are
+     printed empty.  With -j anti only the left fields are printed.  If out
+     is set the record is written to it as a result, see ITEM_HEAD. */
+  uint64_t head[ITEM_HEAD];
+  size_t i, width = sides[RIGHT].width;
+
+  joined.size = 0;
+  outbuf_write(&joined, left, left_len);
+  if (join_type != JOIN_ANTI) {
+    /* Only the headers can be empty, when a file has no records */
+    if (right && right_len) {
+      if (joined.size)
+        outbuf_putc(&joined, delimiter);
+      outbuf_write(&joined, right, right_len);
+    } else if (!right) {
+      for (i = 0; i < width; i++) {
+        if (joined.size)
+          outbuf_putc(&joined, delimiter);
+        outbuf_putc(&joined, quote);
+        outbuf_putc(&joined, quote);
+      }
+    }
+  }
+  outbuf_putc(&joined, '\n');
+
+  if (out) {
+    head[0] = phase;
+    head[1] = seq;
+    head[2] = 0;
+    head[3] = joined.size;
+    item_write(out, head, ITEM_HEAD, joined.data);
+    return;
+  }
+
+  outbuf_write(&output, joined.data, joined.size);
+  if (output.size >= OUTPUT_FLUSH_SIZE)
+    write_output();
+}
+
+void
+join_table_init(join_table *t, int level, FILE *out)
+{
+  size_t i;
+
+  t->entries = NULL;
+  t->entry_count = 0;
+  t->entry_alloc = 0;
+  t->key_count = 0;
+  t->table = NULL;
+  t->table_size = 0;
+  outbuf_init(&t->data);
+  t->level = level;
+  t->split = 0;
+  for (i = 0; i < PARTITIONS; i++)
+    t->build_parts[i] = t->probe_parts[i] = NULL;
+  t->out = out;
+}
+
+void
+join_table_free(join_table *t)
+{
+  size_t i;
+
+  free(t->entries);
+  free(t->table);
+  outbuf_free(&t->data);
+  for (i = 0; i < PARTITIONS; i++) {
+    if (t->build_parts[i])
+      fclose(t->build_parts[i]);
+    if (t->probe_parts[i])
+      fclose(t->probe_parts[i]);
+  }
+  join_table_init(t, t->level, t->out);
+}
+
+size_t
+join_table_memory(join_table *t)
+{
+  return t->entry_alloc * sizeof *t->entries + t->table_size * sizeof *t->table
+         + t->data.alloc;
+}
+
+void
+grow_table(join_table *t)
+{
+  /* Double the number of slots and insert the first entry of each key
+     again */
+  size_t i, j, mask;
+
+  free(t->table);
+  t->table_size = t->table_size ? t->table_size * 2 : 1024;
+  t->table = xmalloc(t->table_size * sizeof *t->table);
+  memset(t->table, 0, t->table_size * sizeof *t->table);
+  mask = t->table_size - 1;
+
+  for (i = 0; i < t->entry_count; i++) {
+    if (t->entries[i].last == 0)
+      continue;
+    for (j = (size_t)(t->entries[i].hash >> 32) & mask; t->table[j]; j = (j + 1) & mask)
+      ;
+    t->table[j] = i + 1;
+  }
+}
+
+size_t *
+find_slot(join_table *t, uint64_t hash, const char *key, size_t key_len)
+{
+  /* Return the slot of the first entry with key, or the empty slot where
+     it belongs.  The table is indexed by the high bits of the hash, the
+     low bits pick the partitions. */
+  size_t i, mask = t->table_size - 1;
+  entry *e;
+
+  for (i = (size_t)(hash >> 32) & mask; t->table[i]; i = (i + 1) & mask) {
+    e = &t->entries[t->table[i] - 1];
+    if (e->hash == hash && e->key_len == key_len
+        && !memcmp(t->data.data + e->data, key, key_len))
+      break;
+  }
+  return &t->table[i];
+}
+
+void
+add_build(join_table *t, const uint64_t *head, const char *data)
+{
+  /* Add a record of the build side to t, the records are added in input
+     order.  head holds the hash of the key, the record number, the length
+     of the key and the length of the key and the record, data the key and
+     the record. */
+  size_t *slot, idx;
+  entry *e, *first;
+
+  if (t->split) {
+    item_write(t->build_parts[partition_index(head[0], t->level)], head, ITEM_HEAD, data);
+    return;
+  }
+
+  if (t->table_size == 0 || t->key_count + 1 > t->table_size / 4 * 3)
+    grow_table(t);
+
+  if (t->entry_count == t->entry_alloc) {
+    t->entry_alloc = t->entry_alloc ? t->entry_alloc * 2 : 1024;
+    t->entries = xrealloc(t->entries, t->entry_alloc * sizeof *t->entries);
+  }
+  idx = t->entry_count++;
+  e = &t->entries[idx];
+  e->hash = head[0];
+  e->seq = head[1];
+  e->key_len = head[2];
+  e->rec_len = head[3] - head[2];
+  e->data = t->data.size;
+  e->next = 0;
+  e->last = 0;
+  e->matched = 0;
+  outbuf_write(&t->data, data, head[3]);
+
+  slot = find_slot(t, head[0], data, head[2]);
+  if (*slot) {
+    first = &t->entries[*slot - 1];
+    t->entries[first->last - 1].next = idx + 1;
+    first->last = idx + 1;
+  } else {
+    *slot = idx + 1;
+    e->last = idx + 1;
+    t->key_count++;
+  }
+
+  if (partition_needed(join_table_memory(t), memory_limit, t->key_count, t->level))
+    split_table(t);
+}
+
+void
+add_probe(join_table *t, const uint64_t *head, const char *data)
+{
+  /* Look up a record of the probe side and print the joined records in
+     the order of the build records with its key */
+  const char *rec = data + head[2];
+  size_t rec_len = head[3] - head[2], *slot, i;
+  entry *e;
+
+  if (t->split) {
+    item_write(t->probe_parts[partition_index(head[0], t->level)], head, ITEM_HEAD, data);
+    return;
+  }
+
+  slot = t->table_size ? find_slot(t, head[0], data, head[2]) : NULL;
+
+  if (slot && *slot) {
+    for (i = *slot; i; i = e->next) {
+      e = &t->entries[i - 1];
+      e->matched = 1;
+      if (join_type == JOIN_ANTI)
+        continue;
+      if (build_side == RIGHT)
+        emit(t->out, 0, head[1], rec, rec_len, t->data.data + e->data + e->key_len, e->rec_len);
+      else
+        emit(t->out, 0, head[1], t->data.data + e->data + e->key_len, e->rec_len, rec, rec_len);
+    }
+  } else if (build_side == RIGHT && join_type != JOIN_INNER) {
+    emit(t->out, 0, head[1], rec, rec_len, NULL, 0);
+  }
+}
+
+void
+split_table(join_table *t)
+{
+  /* Move the build records of t to PARTITIONS temporary files by the hash
+     of their key, the build and probe records added from now on are
+     written to temporary files as well.  Each file is in input order. */
+  uint64_t head[ITEM_HEAD];
+  size_t i;
+  entry *e;
+
+  partitions_open(t->build_parts);
+  partitions_open(t->probe_parts);
+  t->split = 1;
+
+  for (i = 0; i < t->entry_count; i++) {
+    e = &t->entries[i];
+    head[0] = e->hash;
+    head[1] = e->seq;
+    head[2] = e->key_len;
+    head[3] = e->key_len + e->rec_len;
+    add_build(t, head, t->data.data + e->data);
+  }
+
+  free(t->entries);
+  free(t->table);
+  outbuf_free(&t->data);
+  t->entries = NULL;
+  t->entry_count = t->entry_alloc = t->key_count = 0;
+  t->table = NULL;
+  t->table_size = 0;
+}
+
+void
+finish_table(join_table *t)
+{
+  /* Print the build records that did not match with -j left or anti when
+     they are the left side, after the others in input order.  If t was
+     split each partition is joined on its own and the results are merged
+     by their order in the probe side, then in the build side. */
+  FILE *results[PARTITIONS];
+  uint64_t head[ITEM_HEAD];
+  struct outbuf data;
+  join_table sub;
+  size_t i;
+  entry *e;
+
+  if (!t->split) {
+    if (build_side == RIGHT || join_type == JOIN_INNER)
+      return;
+    for (i = 0; i < t->entry_count; i++) {
+      e = &t->entries[i];
+      if (!e->matched)
+        emit(t->out, 1, e->seq, t->data.data + e->data + e->key_len, e->rec_len, NULL, 0);
+    }
+    return;
+  }
+
+  outbuf_init(&data);
+  partitions_open(results);
+  for (i = 0; i < PARTITIONS; i++) {
+    join_table_init(&sub, t->level + 1, results[i]);
+    rewind(t->build_parts[i]);
+    while (item_read(t->build_parts[i], head, ITEM_HEAD, &data))
+      add_build(&sub, head, data.data);
+    rewind(t->probe_parts[i]);
+    while (item_read(t->probe_parts[i], head, ITEM_HEAD, &data))
+      add_probe(&sub, head, data.data);
+    finish_table(&sub);
+    join_table_free(&sub);
+    fclose(t->build_parts[i]);
+    fclose(t->probe_parts[i]);
+    t->build_parts[i] = t->probe_parts[i] = NULL;
+  }
+  outbuf_free(&data);
+
+  /* The results are merged by their phase and record number */
+  item_merge(results, PARTITIONS, ITEM_HEAD, 2, t->out, print_result);
+}
+
+void
+print_result(const uint64_t *head, const char *data, size_t len)
+{
+  outbuf_write(&output, data, len);
+  if (output.size >= OUTPUT_FLUSH_SIZE)
+    write_output();
+}
+
+void
+cb1 (void *data, size_t len, void *vp)
+{
+  side *sd = vp;
+  record_add(&sd->entries, data, len);
+}
+
+void
+cb2 (int c, void *vp)
+{
+  /* Add a record to the hash table or look it up, depending on the side */
+  side *sd = vp;
+  uint64_t head[ITEM_HEAD];
+  size_t i;
+
+  if (sd->first_record) {
+    sd->first_record = 0;
+    sd->width = sd->entries.count;
+    if (write_header) {
+      if (sd->specs.unresolved) {
+        field_specs_resolve(&sd->specs, &sd->entries);
+        if (sd->specs.unresolved) {
+          fprintf(stderr, "Couldn't find field '%s' in %s\n", field_specs_unresolved_name(&sd->specs),
+                  sd->file_name);
+          exit(EXIT_FAILURE);
+        }
+        make_key_fields(sd);
+      }
+      outbuf_fields(&sd->header, &sd->entries, delimiter, quote);
+      record_reset(&sd->entries);
+      return;
+    }
+  }
+
+  key_bytes.size = 0;
+  for (i = 0; i < sd->key_field_count; i++)
+    outbuf_key_field(&key_bytes, &sd->entries, sd->key_fields[i] - 1);
+
+  item_data.size = 0;
+  outbuf_write(&item_data, key_bytes.data, key_bytes.size);
+  outbuf_fields(&item_data, &sd->entries, delimiter, quote);
+
+  head[0] = hash_bytes(key_bytes.data, key_bytes.size, 0);
+  head[1] = sd->current_record++;
+  head[2] = key_bytes.size;
+  head[3] = item_data.size;
+
+  if (sd == &sides[build_side])
+    add_build(&input_table, head, item_data.data);
+  else {
+    print_header();
+    add_probe(&input_table, head, item_data.data);
+  }
+
+  record_reset(&sd->entries);
+}
+
+void
+read_side(side *sd)
+{
+  struct proj_parser p;
+  size_t bytes_read;
+  char buf[65536];
+
+  if (proj_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+    err("Failed to initialize csv parser");
+  proj_set_delim(&p, delimiter);
+  proj_set_quote(&p, quote);
+
+  while ((bytes_read = fread(buf, 1, sizeof buf, sd->fp)) > 0) {
+    if (proj_parse(&p, buf, bytes_read, cb1, cb2, sd) != bytes_read) {
+      fprintf(stderr, "Error while parsing file %s: %s\n", sd->file_name,
+              csv_strerror(proj_error(&p)));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (proj_fini(&p, cb1, cb2, sd)) {
+    fprintf(stderr, "Error while parsing file %s: %s\n", sd->file_name,
+            csv_strerror(proj_error(&p)));
+    exit(EXIT_FAILURE);
+  }
+  proj_free(&p);
+}
+
+long
+file_size(FILE *fp)
+{
+  /* Return the size of a file, or LONG_MAX if it can't be found */
+  long size;
+
+  if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0
+      || fseek(fp, 0, SEEK_SET) != 0)
+    return LONG_MAX;
+  return size;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int optc, i;
+  char *field_list = NULL;
+  char *side_lists[2] = {NULL, NULL};
+
+  program_name = argv[0];
+
+  while ((optc = getopt_long(argc, argv, "d:f:1:2:hj:q:s", longopts, NULL)) != -1)
+    switch (optc) {
+      case 'd':
+        if (strlen(optarg) > 1)
+          err("delimiter must be exactly one byte long");
+        else
+          delimiter = optarg[0];
+        break;
+
+      case 'f':
+        field_list = optarg;
+        break;
+
+      case '1':
+        side_lists[LEFT] = optarg;
+        break;
+
+      case '2':
+        side_lists[RIGHT] = optarg;
+        break;
+
+      case 'h':
+        write_header = 1;
+        break;
+
+      case 'j':
+        if (!strcmp(optarg, "inner"))
+          join_type = JOIN_INNER;
+        else if (!strcmp(optarg, "left"))
+          join_type = JOIN_LEFT;
+        else if (!strcmp(optarg, "anti"))
+          join_type = JOIN_ANTI;
+        else
+          err("the join type must be inner, left or anti");
+        break;
+
+      case 'q':
+        if (strlen(optarg) > 1)
+          err("quote must be exactly one byte long");
+        else
+          quote = optarg[0];
+        break;
+
+      case 's':
+        strict = 1;
+        break;
+
+      case CHAR_MAX + 1:
+        /* --version */
+        print_version(PROGRAM_NAME);
+        break;
+
+      case CHAR_MAX + 2:
+        /* --help */
+        usage(EXIT_SUCCESS);
+        break;
+
+      case CHAR_MAX + 3:
+        /* --memory */
+        if (Parse_size(optarg, &memory_limit) != 0 || memory_limit < 1)
+          err("Invalid memory size");
+        break;
+
+      default:
+        usage(EXIT_FAILURE);
+    }
+
+  atexit(cleanup);
+
+  if (optind + 2 != argc)
+    usage(EXIT_FAILURE);
+
+  for (i = 0; i < 2; i++) {
+    if (!side_lists[i])
+      side_lists[i] = field_list;
+    if (!side_lists[i])
+      err("Must specify the fields to join on");
+  }
+
+  for (i = 0; i < 2; i++) {
+    sides[i].first_record = 1;
+    sides[i].file_name = argv[optind + i];
+    field_specs_parse(&sides[i].specs, side_lists[i], 0);
+    if (sides[i].specs.unresolved)
+      write_header = 1;
+  }
+  for (i = 0; i < 2; i++)
+    if (!sides[i].specs.unresolved)
+      make_key_fields(&sides[i]);
+
+  for (i = 0; i < 2; i++) {
+    if (!strcmp(sides[i].file_name, "-")) {
+      if (i == RIGHT && sides[LEFT].fp == stdin)
+        err("Only one file can be standard input");
+      sides[i].fp = stdin;
+      sides[i].size = LONG_MAX;
+    } else {
+      if ((sides[i].fp = fopen(sides[i].file_name, "rb")) == NULL)
+        err("Could not open file");
+      sides[i].size = file_size(sides[i].fp);
+    }
+  }
+
+  /* The table is built from the smaller file and the other one is read
+     as it comes */
+  build_side = sides[LEFT].size < sides[RIGHT].size ? LEFT : RIGHT;
+
+  join_table_init(&input_table, 0, NULL);
+  read_side(&sides[build_side]);
+  read_side(&sides[!build_side]);
+  print_header();
+  finish_table(&input_table);
+  write_output();
+
+  for (i = 0; i < 2; i++)
+    if (sides[i].fp != stdin)
+      fclose(sides[i].fp);
+
+  exit(EXIT_SUCCESS);
+}
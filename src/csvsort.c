@@ -0,0 +1,1029 @@
+/*
+csvsort - Sort CSV records on the values of the specified fields
+
+Copyright (C) 2007  Robert Gamble
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <math.h>
+#include "libcsv/csv.h"
+#include "version.h"
+#include "helper.h"
+
+#define PROGRAM_NAME "csvsort"
+#define AUTHORS "Robert Gamble"
+
+/* Sorted output is written once this much of it is buffered */
+#define OUTPUT_FLUSH_SIZE 65536
+
+/* Every record is kept as an entry made of the key and record lengths
+   followed by the key and the record, see add_entry() */
+#define ENTRY_HEAD_SIZE (2 * sizeof(uint64_t))
+
+/* Buckets of the radix sort with fewer entries are sorted by insertion */
+#define RADIX_CUTOFF 16
+
+/* Records waiting to be sorted, the entries are in input order */
+typedef struct batch {
+  struct outbuf data;       /* The entries back to back */
+  size_t *offsets;          /* The offset of each entry in data */
+  size_t count;             /* The number of entries */
+  size_t alloc;             /* Elements allocated for offsets */
+} batch;
+
+/* One of the sorted inputs of a merge, either a run or sorted entries in
+   memory */
+typedef struct source {
+  FILE *fp;                 /* The run, NULL for entries in memory */
+  const char *pos;          /* The entries in memory not reached yet */
+  const char *end;
+  struct outbuf buf;        /* The current entry read from the run */
+  const char *entry;        /* The current entry, NULL when exhausted */
+} source;
+
+/* The state of a parser adding records to a batch */
+typedef struct sort_state {
+  struct proj_parser parser;
+  struct record entries;    /* The fields of the current record */
+  batch *b;                 /* The batch records are added to */
+} sort_state;
+
+/* An entry being sorted and 8 bytes of its key from the offset the radix
+   sort got to, see radix_sort() */
+typedef struct item {
+  uint64_t prefix;          /* The key bytes as a big endian number */
+  const char *entry;
+} item;
+
+static struct option const longopts[] =
+{
+  {"delimiter", required_argument, NULL, 'd'},
+  {"field", required_argument, NULL, 'f'},
+  {"header", no_argument, NULL, 'h'},
+  {"numeric", no_argument, NULL, 'n'},
+  {"ignore-case", no_argument, NULL, 'i'},
+  {"quote", required_argument, NULL, 'q'},
+  {"reverse", no_argument, NULL, 'r'},
+  {"strict", no_argument, NULL, 's'},
+  {"version", no_argument, NULL, CHAR_MAX + 1},
+  {"help", no_argument, NULL, CHAR_MAX + 2},
+  {"stable", no_argument, NULL, CHAR_MAX + 3},
+  {"memory", required_argument, NULL, CHAR_MAX + 4},
+  {"threads", required_argument, NULL, CHAR_MAX + 5},
+  {NULL, 0, NULL, 0}
+};
+
+/* The name this program was called with */
+char *program_name;
+
+/* The current input file */
+FILE *infile;
+
+/* The delimiter character */
+char delimiter = CSV_COMMA;
+
+/* The quote character */
+char quote = CSV_QUOTE;
+
+/* Enforce strict CSV? */
+int strict;
+
+/* If set, the first record is a header and is printed first */
+int write_header;
+
+/* Compare the key fields as numbers if set */
+int numeric;
+
+/* Compare the key fields with lower case letters folded to upper case if
+   set */
+int ignore_case;
+
+/* Sort in descending order if set */
+int reverse;
+
+/* Keep records with equal keys in input order if set */
+int stable;
+
+/* The most memory to use for records being sorted */
+size_t memory_limit = 64 * 1024 * 1024;
+
+/* The number of threads to use */
+int threads = 1;
+
+/* The field specifications */
+struct field_specs specs;
+
+/* The numbers of the fields to sort on, in order */
+size_t *key_fields;
+
+/* The number of key fields */
+size_t key_field_count;
+
+/* True while the current record is the first non-empty record */
+int first_record = 1;
+
+/* The records read without --threads */
+batch input;
+
+/* Sorted chunks in memory with --threads, oldest first */
+struct outbuf *pending;
+size_t pending_count;
+size_t pending_alloc;
+
+/* The memory allocated for pending */
+size_t pending_memory;
+
+/* The runs of sorted entries not merged yet */
+struct run_list runs;
+
+/* Sorted output waiting to be written */
+struct outbuf output;
+
+void write_output(void);
+void batch_init(batch *b);
+void batch_free(batch *b);
+size_t batch_memory(batch *b);
+void add_entry(batch *b, struct record *r);
+size_t entry_size(const char *e);
+void print_entry(const char *e);
+int parse_number(const char *s, size_t len, double *value);
+int compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len);
+void put_key_field(struct outbuf *b, const char *s, size_t len);
+int compare_entries(const char *a, const char *b);
+int compare_items(const void *a, const void *b);
+uint64_t key_prefix(const char *e, size_t offset);
+void insertion_sort(item *a, size_t n);
+void radix_sort(item *a, size_t n, size_t offset, int depth);
+item *sort_batch(batch *b);
+void print_batch(batch *b);
+void spill_batch(batch *b);
+void next_entry(source *s);
+int beats(source *src, size_t n, size_t a, size_t b);
+void replay(source *src, size_t n, size_t *tree, size_t s);
+void merge_sources(source *src, size_t n, FILE *out);
+void merge_runs(struct run *in, size_t n, struct outbuf *chunks, size_t chunk_count, FILE *out);
+void merge_run_files(struct run *in, size_t n, FILE *out);
+void spill_pending(void);
+void init_state(sort_state *st, batch *b);
+void free_state(sort_state *st);
+void cb1 (void *data, size_t len, void *vp);
+void cb2 (int c, void *vp);
+void sort_chunk(struct chunk *c, void *arg);
+int finish_chunk(struct chunk *c, void *arg);
+void sort_file(void);
+void usage (int status);
+void cleanup(void);
+
+
+void
+cleanup(void)
+{
+  /* Free memory, the runs are removed when closed */
+  size_t i;
+
+  field_specs_free(&specs);
+  free(key_fields);
+  batch_free(&input);
+  for (i = 0; i < pending_count; i++)
+    outbuf_free(&pending[i]);
+  free(pending);
+  run_list_free(&runs);
+  outbuf_free(&output);
+}
+
+void
+usage (int status)
+{
+  if (status != EXIT_SUCCESS)
+    fprintf (stderr, "Try `%s --help for more information.\n", program_name);
+  else {
+    printf("\
+Usage: %s -f FIELD_LIST [OPTIONS]... [FILE]\n\
+Sort CSV records on the values of the specified fields\n\
+\n\
+  -d, --delimiter=DELIM_CHAR   use DELIM_CHAR instead of comma as delimiter\n\
+  -f, --field=FIELD_LIST       the field names or numbers to sort on, later\n\
+                               fields are compared when earlier ones are equal\n\
+  -h, --header                 print the first record first without sorting it\n\
+", program_name);
+    printf("\
+  -i, --ignore-case            fold lower case to upper case characters when\n\
+                               comparing\n\
+  -n, --numeric                compare the fields as numbers\n\
+  -q, --quote=QUOTE_CHAR       use QUOTE_CHAR instead of double quote as quote\n\
+                               character\n\
+  -r, --reverse                sort in descending order\n\
+  -s, --strict                 enforce strict mode, mal-formed CSV files will\n\
+                               cause an error\n\
+");
+    printf("\
+      --stable                 keep records with equal keys in input order\n\
+      --memory=SIZE            sort at most SIZE bytes of records in memory,\n\
+                               larger inputs are sorted using temporary files\n\
+      --threads=N              use N threads to parse and sort the input\n\
+      --version                display version information and exit\n\
+      --help                   display this help and exit\n\
+");
+  }
+  exit(status);
+}
+
+void
+write_output(void)
+{
+  if (outbuf_flush(&output, stdout) != 0)
+    err("Failed to write output");
+}
+
+void
+batch_init(batch *b)
+{
+  outbuf_init(&b->data);
+  b->offsets = NULL;
+  b->count = 0;
+  b->alloc = 0;
+}
+
+void
+batch_free(batch *b)
+{
+  outbuf_free(&b->data);
+  free(b->offsets);
+  batch_init(b);
+}
+
+size_t
+batch_memory(batch *b)
+{
+  /* The memory used by the entries of b, sorting needs an item for each
+     of them.  The buffers are kept when b is spilled, so their size is
+     not what counts. */
+  return b->data.size + b->count * (sizeof *b->offsets + sizeof(item));
+}
+
+void
+add_entry(batch *b, struct record *r)
+{
+  /* Add r to b as an entry.  The key is made of the key fields encoded by
+     put_key_field(), the record is stored as it is printed. */
+  uint64_t head[2];
+  size_t start = b->data.size, i, idx;
+
+  if (b->count == b->alloc) {
+    b->alloc = b->alloc ? b->alloc * 2 : 1024;
+    b->offsets = xrealloc(b->offsets, b->alloc * sizeof *b->offsets);
+  }
+  b->offsets[b->count++] = start;
+
+  outbuf_reserve(&b->data, sizeof head);
+  b->data.size += sizeof head;
+
+  for (i = 0; i < key_field_count; i++) {
+    idx = key_fields[i] - 1;
+    /* A field missing from the record is empty */
+    if (idx < r->count)
+      put_key_field(&b->data, record_field(r, idx), record_field_size(r, idx));
+    else
+      put_key_field(&b->data, "", 0);
+  }
+  head[0] = b->data.size - start - sizeof head;
+
+  outbuf_fields(&b->data, r, delimiter, quote);
+  outbuf_putc(&b->data, '\n');
+  head[1] = b->data.size - start - sizeof head - head[0];
+  memcpy(b->data.data + start, head, sizeof head);
+}
+
+size_t
+entry_size(const char *e)
+{
+  uint64_t head[2];
+  memcpy(head, e, sizeof head);
+  return ENTRY_HEAD_SIZE + head[0] + head[1];
+}
+
+void
+print_entry(const char *e)
+{
+  /* Print the record of an entry */
+  uint64_t head[2];
+
+  memcpy(head, e, sizeof head);
+  outbuf_write(&output, e + ENTRY_HEAD_SIZE + head[0], head[1]);
+  if (output.size >= OUTPUT_FLUSH_SIZE)
+    write_output();
+}
+
+int
+parse_number(const char *s, size_t len, double *value)
+{
+  /* Convert a key field to a number, return 0 if it isn't one.  Fields
+     are not null terminated, short ones are copied to buf. */
+  char buf[64], *copy, *end;
+  int is_number;
+
+  if (len == 0)
+    return 0;
+  copy = len < sizeof buf ? buf : xmalloc(len + 1);
+  memcpy(copy, s, len);
+  copy[len] = '\0';
+
+  *value = strtod(copy, &end);
+  is_number = end != copy && !isnan(*value);
+  while (end < copy + len && isspace((unsigned char)*end))
+    end++;
+  is_number = is_number && end == copy + len;
+
+  if (copy != buf)
+    free(copy);
+  return is_number;
+}
+
+int
+compare_bytes(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp)
+    return cmp;
+  return (a_len > b_len) - (a_len < b_len);
+}
+
+void
+put_key_field(struct outbuf *b, const char *s, size_t len)
+{
+  /* Append a key field encoded so that keys compare with memcmp() the way
+     their fields compare one after the other.  A string has each null
+     byte followed by 0xff and ends with two null bytes, so a string goes
+     before any longer string starting with it whatever follows.  With
+     --numeric a number is 2 followed by the bits of the double, the sign
+     bit flipped for positive numbers and all bits for negative ones, in
+     big endian order.  Other values are 1 followed by the string, they go
+     before all numbers.  With --reverse every byte is inverted. */
+  size_t start = b->size, i, run;
+  const char *z;
+  uint64_t bits;
+  double v;
+
+  if (numeric) {
+    if (parse_number(s, len, &v)) {
+      /* -0 and 0 are equal */
+      if (v == 0)
+        v = 0;
+      memcpy(&bits, &v, sizeof bits);
+      bits = bits >> 63 ? ~bits : bits | (uint64_t)1 << 63;
+      outbuf_reserve(b, 9);
+      b->data[b->size++] = 2;
+      for (i = 0; i < 8; i++)
+        b->data[b->size++] = (char)(bits >> (56 - 8 * i));
+      goto done;
+    }
+    outbuf_putc(b, 1);
+  }
+
+  if (ignore_case) {
+    outbuf_reserve(b, 2 * len);
+    for (i = 0; i < len; i++) {
+      b->data[b->size++] = (char)toupper((unsigned char)s[i]);
+      if (s[i] == '\0')
+        b->data[b->size++] = (char)0xff;
+    }
+  } else {
+    while (len) {
+      z = memchr(s, '\0', len);
+      run = z ? (size_t)(z - s) + 1 : len;
+      outbuf_write(b, s, run);
+      if (z)
+        outbuf_putc(b, (char)0xff);
+      s += run;
+      len -= run;
+    }
+  }
+  outbuf_putc(b, '\0');
+  outbuf_putc(b, '\0');
+
+ done:
+  if (reverse)
+    for (i = start; i < b->size; i++)
+      b->data[i] = ~b->data[i];
+}
+
+int
+compare_entries(const char *a, const char *b)
+{
+  /* Compare the keys of two entries.  Without --stable entries with equal
+     keys are compared by their records like sort(1) does, so the output
+     does not depend on how the input was split. */
+  uint64_t a_head[2], b_head[2];
+  int cmp;
+
+  memcpy(a_head, a, sizeof a_head);
+  memcpy(b_head, b, sizeof b_head);
+  cmp = compare_bytes(a + ENTRY_HEAD_SIZE, a_head[0], b + ENTRY_HEAD_SIZE, b_head[0]);
+  if (cmp || stable)
+    return cmp;
+
+  cmp = compare_bytes(a + ENTRY_HEAD_SIZE + a_head[0], a_head[1],
+                      b + ENTRY_HEAD_SIZE + b_head[0], b_head[1]);
+  return reverse ? -cmp : cmp;
+}
+
+int
+compare_items(const void *a, const void *b)
+{
+  /* The prefixes are compared first.  The entries of a batch are in input
+     order, equal entries are kept in that order. */
+  const item *x = a, *y = b;
+  int cmp;
+
+  if (x->prefix != y->prefix)
+    return x->prefix < y->prefix ? -1 : 1;
+  if ((cmp = compare_entries(x->entry, y->entry)) != 0)
+    return cmp;
+  return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+uint64_t
+key_prefix(const char *e, size_t offset)
+{
+  /* Return the 8 key bytes of e from offset on as a big endian number,
+     padded with null bytes past the end of the key */
+  const unsigned char *key = (const unsigned char *)e + ENTRY_HEAD_SIZE;
+  uint64_t head[2], prefix = 0;
+  size_t i;
+
+  memcpy(head, e, sizeof head);
+  for (i = 0; i < 8; i++) {
+    prefix <<= 8;
+    if (offset + i < head[0])
+      prefix |= key[offset + i];
+  }
+  return prefix;
+}
+
+void
+insertion_sort(item *a, size_t n)
+{
+  size_t i, j;
+  item t;
+
+  for (i = 1; i < n; i++) {
+    t = a[i];
+    for (j = i; j > 0 && compare_items(&t, &a[j - 1]) < 0; j--)
+      a[j] = a[j - 1];
+    a[j] = t;
+  }
+}
+
+void
+radix_sort(item *a, size_t n, size_t offset, int depth)
+{
+  /* MSD radix sort of items whose keys are equal before byte offset plus
+     depth, on that byte which is byte depth of the prefixes.  The items
+     are moved to their buckets in place and the buckets are sorted on the
+     next byte, the prefixes are loaded from the keys again every 8 bytes
+     so most bytes are read from the items and not from the entries.
+     Small buckets are sorted by comparing the items, so are items with
+     equal keys to order them by record or input order. */
+  size_t count[256], next[256], end[256];
+  size_t i, b, d, largest;
+  uint64_t key_len;
+  int shift;
+  item t, swap;
+
+  for (;;) {
+    if (n < RADIX_CUTOFF) {
+      insertion_sort(a, n);
+      return;
+    }
+
+    if (depth == 8) {
+      /* The keys encoded by put_key_field() are never the start of other
+         keys, if one of them ended all of them are equal */
+      memcpy(&key_len, a[0].entry, sizeof key_len);
+      if (key_len <= offset + 8) {
+        qsort(a, n, sizeof *a, compare_items);
+        return;
+      }
+      offset += 8;
+      depth = 0;
+      for (i = 0; i < n; i++)
+        a[i].prefix = key_prefix(a[i].entry, offset);
+    }
+
+    shift = 56 - 8 * depth++;
+    memset(count, 0, sizeof count);
+    for (i = 0; i < n; i++)
+      count[(a[i].prefix >> shift) & 0xff]++;
+    if (count[(a[0].prefix >> shift) & 0xff] == n)
+      continue;
+
+    for (i = 0, b = 0; b < 256; b++) {
+      next[b] = i;
+      i += count[b];
+      end[b] = i;
+    }
+    for (b = 0; b < 256; b++) {
+      while (next[b] < end[b]) {
+        t = a[next[b]];
+        while ((d = (t.prefix >> shift) & 0xff) != b) {
+          swap = a[next[d]];
+          a[next[d]++] = t;
+          t = swap;
+        }
+        a[next[b]++] = t;
+      }
+    }
+
+    /* The largest bucket is sorted by this loop, so the recursion is only
+       as deep as the number of times the items can be halved */
+    largest = 0;
+    for (b = 1; b < 256; b++)
+      if (count[b] > count[largest])
+        largest = b;
+    for (i = 0, b = 0; b < 256; i += count[b], b++)
+      if (b != largest && count[b] > 1)
+        radix_sort(a + i, count[b], offset, depth);
+    a += end[largest] - count[largest];
+    n = count[largest];
+  }
+}
+
+item *
+sort_batch(batch *b)
+{
+  /* Return the entries of b in sorted order */
+  item *items = xmalloc((b->count + 1) * sizeof *items);
+  size_t i;
+
+  for (i = 0; i < b->count; i++) {
+    items[i].entry = b->data.data + b->offsets[i];
+    items[i].prefix = key_prefix(items[i].entry, 0);
+  }
+  radix_sort(items, b->count, 0, 0);
+  return items;
+}
+
+void
+print_batch(batch *b)
+{
+  item *items = sort_batch(b);
+  size_t i;
+
+  for (i = 0; i < b->count; i++)
+    print_entry(items[i].entry);
+  free(items);
+}
+
+void
+spill_batch(batch *b)
+{
+  /* Write the entries of b to a new run in sorted order and empty b */
+  item *items = sort_batch(b);
+  FILE *fp = run_file();
+  size_t i, size;
+
+  for (i = 0; i < b->count; i++) {
+    size = entry_size(items[i].entry);
+    if (fwrite(items[i].entry, 1, size, fp) != size)
+      err("Failed to write temporary file");
+  }
+  free(items);
+  b->data.size = 0;
+  b->count = 0;
+  run_list_add(&runs, fp);
+}
+
+void
+next_entry(source *s)
+{
+  /* Move to the next entry of a source, entry is NULL at the end */
+  uint64_t head[2];
+  size_t size;
+
+  if (s->fp == NULL) {
+    if (s->pos == s->end) {
+      s->entry = NULL;
+      return;
+    }
+    s->entry = s->pos;
+    s->pos += entry_size(s->pos);
+    return;
+  }
+
+  if (fread(head, sizeof head, 1, s->fp) != 1) {
+    if (ferror(s->fp))
+      err("Failed to read temporary file");
+    s->entry = NULL;
+    return;
+  }
+  size = head[0] + head[1];
+  s->buf.size = 0;
+  outbuf_reserve(&s->buf, sizeof head + size);
+  memcpy(s->buf.data, head, sizeof head);
+  if (fread(s->buf.data + sizeof head, 1, size, s->fp) != size)
+    err("Failed to read temporary file");
+  s->entry = s->buf.data;
+}
+
+int
+beats(source *src, size_t n, size_t a, size_t b)
+{
+  /* Return true if the current entry of source a goes before the one of
+     source b.  n stands for a source that goes before all the others and
+     an exhausted source goes after all the others.  Equal entries are
+     taken from the earlier source first. */
+  int cmp;
+
+  if (a == n)
+    return 1;
+  if (b == n || src[a].entry == NULL)
+    return 0;
+  if (src[b].entry == NULL)
+    return 1;
+  cmp = compare_entries(src[a].entry, src[b].entry);
+  return cmp < 0 || (cmp == 0 && a < b);
+}
+
+void
+replay(source *src, size_t n, size_t *tree, size_t s)
+{
+  /* Play source s from its leaf up to the root of the loser tree, each
+     node keeps the loser of the game played there and the winner goes on */
+  size_t t, tmp;
+
+  for (t = (s + n) / 2; t > 0; t /= 2) {
+    if (beats(src, n, tree[t], s)) {
+      tmp = tree[t];
+      tree[t] = s;
+      s = tmp;
+    }
+  }
+  tree[0] = s;
+}
+
+void
+merge_sources(source *src, size_t n, FILE *out)
+{
+  /* Merge the sources with a loser tree, tree[0] is the source with the
+     smallest entry and finding the next one takes one comparison per
+     level.  The entries are written to the run out, or the records are
+     printed if out is NULL. */
+  size_t *tree = xmalloc(n * sizeof *tree);
+  size_t i, s, size;
+
+  for (i = 0; i < n; i++) {
+    next_entry(&src[i]);
+    tree[i] = n;
+  }
+  for (i = n; i-- > 0; )
+    replay(src, n, tree, i);
+
+  while (src[s = tree[0]].entry) {
+    if (out) {
+      size = entry_size(src[s].entry);
+      if (fwrite(src[s].entry, 1, size, out) != size)
+        err("Failed to write temporary file");
+    } else
+      print_entry(src[s].entry);
+    next_entry(&src[s]);
+    replay(src, n, tree, s);
+  }
+
+  free(tree);
+}
+
+void
+merge_runs(struct run *in, size_t n, struct outbuf *chunks, size_t chunk_count, FILE *out)
+{
+  /* Merge n runs followed by chunk_count sorted chunks in memory, in input
+     order, and close the runs */
+  source *src = xmalloc((n + chunk_count) * sizeof *src);
+  size_t i;
+
+  for (i = 0; i < n + chunk_count; i++) {
+    outbuf_init(&src[i].buf);
+    if (i < n) {
+      rewind(in[i].fp);
+      src[i].fp = in[i].fp;
+    } else {
+      src[i].fp = NULL;
+      src[i].pos = chunks[i - n].data;
+      src[i].end = chunks[i - n].data + chunks[i - n].size;
+    }
+  }
+
+  merge_sources(src, n + chunk_count, out);
+
+  for (i = 0; i < n + chunk_count; i++) {
+    outbuf_free(&src[i].buf);
+    if (i < n)
+      fclose(in[i].fp);
+  }
+  free(src);
+}
+
+void
+merge_run_files(struct run *in, size_t n, FILE *out)
+{
+  merge_runs(in, n, NULL, 0, out);
+}
+
+void
+spill_pending(void)
+{
+  /* Merge the sorted chunks in memory into a new run */
+  FILE *fp = run_file();
+  size_t i;
+
+  merge_runs(NULL, 0, pending, pending_count, fp);
+  for (i = 0; i < pending_count; i++)
+    outbuf_free(&pending[i]);
+  pending_count = 0;
+  pending_memory = 0;
+  run_list_add(&runs, fp);
+}
+
+void
+init_state(sort_state *st, batch *b)
+{
+  if (proj_init(&st->parser, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+    err("Failed to initialize csv parser");
+  proj_set_delim(&st->parser, delimiter);
+  proj_set_quote(&st->parser, quote);
+  record_init(&st->entries);
+  st->b = b;
+}
+
+void
+free_state(sort_state *st)
+{
+  proj_free(&st->parser);
+  record_free(&st->entries);
+}
+
+void
+cb1 (void *data, size_t len, void *vp)
+{
+  sort_state *st = vp;
+  record_add(&st->entries, data, len);
+}
+
+void
+cb2 (int c, void *vp)
+{
+  /* The header is only seen from the main thread, see sort_chunk() */
+  sort_state *st = vp;
+
+  if (first_record) {
+    first_record = 0;
+    if (write_header) {
+      outbuf_fields(&output, &st->entries, delimiter, quote);
+      outbuf_putc(&output, '\n');
+      if (specs.unresolved) {
+        field_specs_resolve(&specs, &st->entries);
+        if (specs.unresolved) {
+          fprintf(stderr, "Couldn't find field '%s'\n", field_specs_unresolved_name(&specs));
+          exit(EXIT_FAILURE);
+        }
+        key_fields = field_specs_fields(&specs, &key_field_count);
+      }
+      record_reset(&st->entries);
+      return;
+    }
+  }
+
+  add_entry(st->b, &st->entries);
+  record_reset(&st->entries);
+}
+
+void
+sort_chunk(struct chunk *c, void *arg)
+{
+  /* Parse a chunk and store its entries in c->out in sorted order.  Until
+     the first record has been seen this is called from the main thread. */
+  sort_state st;
+  batch b;
+  item *items;
+  size_t i;
+
+  batch_init(&b);
+  init_state(&st, &b);
+  if (proj_parse(&st.parser, c->data, c->size, cb1, cb2, &st) != c->size
+      || (c->last && proj_fini(&st.parser, cb1, cb2, &st) != 0))
+    c->status = proj_error(&st.parser);
+
+  items = sort_batch(&b);
+  outbuf_reserve(&c->out, b.data.size);
+  for (i = 0; i < b.count; i++)
+    outbuf_write(&c->out, items[i].entry, entry_size(items[i].entry));
+
+  free(items);
+  free_state(&st);
+  batch_free(&b);
+}
+
+int
+finish_chunk(struct chunk *c, void *arg)
+{
+  /* Keep the sorted entries of a chunk until the chunks kept use more
+     than --memory, then merge them into a run.  Chunks are finished in
+     input order. */
+  if (c->status) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(c->status));
+    return 1;
+  }
+  if (c->out.size == 0)
+    return 0;
+
+  if (pending_count == pending_alloc) {
+    pending_alloc = pending_alloc ? pending_alloc * 2 : 16;
+    pending = xrealloc(pending, pending_alloc * sizeof *pending);
+  }
+  /* Take the buffer over, the chunk gets a new one */
+  pending[pending_count++] = c->out;
+  pending_memory += c->out.alloc;
+  outbuf_init(&c->out);
+
+  if (pending_memory >= memory_limit)
+    spill_pending();
+  return 0;
+}
+
+void
+sort_file(void)
+{
+  /* Read the input into batches, a batch is written to a run when it uses
+     more than --memory */
+  sort_state st;
+  size_t bytes_read;
+  char buf[65536];
+
+#ifndef WITHOUT_THREADS
+  if (threads > 1) {
+    /* The header and the field names are handled before workers start */
+    if (parallel_chunks(infile, threads, delimiter, quote, sort_chunk, finish_chunk, NULL, &first_record))
+      exit(EXIT_FAILURE);
+    return;
+  }
+#endif
+
+  init_state(&st, &input);
+
+  while ((bytes_read = fread(buf, 1, sizeof buf, infile)) > 0) {
+    if (proj_parse(&st.parser, buf, bytes_read, cb1, cb2, &st) != bytes_read) {
+      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&st.parser)));
+      exit(EXIT_FAILURE);
+    }
+    if (batch_memory(&input) >= memory_limit)
+      spill_batch(&input);
+  }
+
+  if (proj_fini(&st.parser, cb1, cb2, &st)) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&st.parser)));
+    exit(EXIT_FAILURE);
+  }
+
+  free_state(&st);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int optc;
+  char *field_list = NULL;
+
+  program_name = argv[0];
+
+  while ((optc = getopt_long(argc, argv, "d:f:hinq:rs", longopts, NULL)) != -1)
+    switch (optc) {
+      case 'd':
+        if (strlen(optarg) > 1)
+          err("delimiter must be exactly one byte long");
+        else
+          delimiter = optarg[0];
+        break;
+
+      case 'f':
+        field_list = optarg;
+        break;
+
+      case 'h':
+        write_header = 1;
+        break;
+
+      case 'i':
+        ignore_case = 1;
+        break;
+
+      case 'n':
+        numeric = 1;
+        break;
+
+      case 'q':
+        if (strlen(optarg) > 1)
+          err("quote must be exactly one byte long");
+        else
+          quote = optarg[0];
+        break;
+
+      case 'r':
+        reverse = 1;
+        break;
+
+      case 's':
+        strict = 1;
+        break;
+
+      case CHAR_MAX + 1:
+        /* --version */
+        print_version(PROGRAM_NAME);
+        break;
+
+      case CHAR_MAX + 2:
+        /* --help */
+        usage(EXIT_SUCCESS);
+        break;
+
+      case CHAR_MAX + 3:
+        /* --stable */
+        stable = 1;
+        break;
+
+      case CHAR_MAX + 4:
+        /* --memory */
+        if (Parse_size(optarg, &memory_limit) != 0 || memory_limit < 1)
+          err("Invalid memory size");
+        break;
+
+      case CHAR_MAX + 5:
+        /* --threads */
+        if (!Is_numeric(optarg) || (threads = atoi(optarg)) < 1)
+          err("the number of threads must be a positive number");
+#ifdef WITHOUT_THREADS
+        if (threads > 1)
+          err("not compiled with thread support");
+#endif
+        break;
+
+      default:
+        usage(EXIT_FAILURE);
+    }
+
+  atexit(cleanup);
+  run_list_init(&runs, merge_run_files);
+
+  if (!field_list)
+    err("Must specify the fields to sort on");
+
+  field_specs_parse(&specs, field_list, 0);
+  if (specs.unresolved)
+    write_header = 1;
+  else
+    key_fields = field_specs_fields(&specs, &key_field_count);
+
+  if (optind < argc) {
+    if (optind + 1 < argc)
+      usage(EXIT_FAILURE);
+    infile = fopen(argv[optind], "rb");
+    if (!infile)
+      err("Could not open file");
+  } else {
+    infile = stdin;
+  }
+
+  sort_file();
+
+  /* Everything fits in memory unless runs were written */
+  if (input.count) {
+    if (runs.count)
+      spill_batch(&input);
+    else
+      print_batch(&input);
+  }
+  if (runs.count || pending_count) {
+    merge_runs(runs.runs, runs.count, pending, pending_count, NULL);
+    runs.count = 0;
+  }
+  write_output();
+
+  exit(EXIT_SUCCESS);
+}
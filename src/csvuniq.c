@@ -0,0 +1,629 @@
+/*
+csvuniq - Print the first of the CSV records with the same values in
+          the specified fields
+
+Copyright (C) 2007  Robert Gamble
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <ctype.h>
+#include "libcsv/csv.h"
+#include "version.h"
+#include "helper.h"
+
+#define PROGRAM_NAME "csvuniq"
+#define AUTHORS "Robert Gamble"
+
+/* Output is written once this much of it is buffered */
+#define OUTPUT_FLUSH_SIZE 65536
+
+/* The items in temporary files are made of the number of the first
+   record of a key, the key hash, the length of the key, the number of
+   records, whether the first was printed and the length of the key and
+   the record, followed by the key and the record, see add_item() */
+#define ITEM_HEAD 6
+
+/* A distinct key, its fields are kept so records with the same hash but
+   different values are told apart */
+typedef struct key {
+  uint64_t hash;            /* hash_bytes() of the key fields */
+  size_t key;               /* The key fields, an offset in data */
+  size_t key_len;
+  uint64_t seq;             /* The number of the first record with the key */
+  uint64_t count;           /* The number of records with the key */
+  uint64_t printed;         /* Set once the first record was printed */
+  size_t rec;               /* The first record, an offset in data */
+  size_t rec_len;
+} key;
+
+/* The keys seen in the input, or in a partition of it */
+typedef struct key_set {
+  key *keys;                /* The keys in the order first seen */
+  size_t key_count;
+  size_t key_alloc;
+  size_t *table;            /* Open addressed table of keys indexes plus
+                               one, 0 marks an empty slot */
+  size_t table_size;        /* The number of slots, a power of 2 */
+  struct outbuf data;       /* The keys and the first records of them */
+  int level;                /* The number of times the input was split */
+  FILE *parts[PARTITIONS];  /* The partitions once split, or NULL */
+} key_set;
+
+static struct option const longopts[] =
+{
+  {"count", no_argument, NULL, 'c'},
+  {"delimiter", required_argument, NULL, 'd'},
+  {"fields", required_argument, NULL, 'f'},
+  {"header", no_argument, NULL, 'h'},
+  {"quote", required_argument, NULL, 'q'},
+  {"strict", no_argument, NULL, 's'},
+  {"version", no_argument, NULL, CHAR_MAX + 1},
+  {"help", no_argument, NULL, CHAR_MAX + 2},
+  {"duplicates-only", no_argument, NULL, CHAR_MAX + 3},
+  {"memory", required_argument, NULL, CHAR_MAX + 4},
+  {NULL, 0, NULL, 0}
+};
+
+/* The name this program was called with */
+char *program_name;
+
+/* The current input file */
+FILE *infile;
+
+/* The delimiter character */
+char delimiter = CSV_COMMA;
+
+/* The quote character */
+char quote = CSV_QUOTE;
+
+/* Enforce strict CSV? */
+int strict;
+
+/* If set, the first record is a header and is printed first */
+int write_header;
+
+/* Print the number of records with each key before the record if set */
+int print_counts;
+
+/* Only print the keys seen more than once if set */
+int duplicates_only;
+
+/* The most memory to use for the keys */
+size_t memory_limit = 64 * 1024 * 1024;
+
+/* The field specifications */
+struct field_specs specs;
+
+/* The numbers of the key fields in order, all fields if there are none */
+size_t *key_fields;
+
+/* The number of key fields */
+size_t key_field_count;
+
+/* True while the current record is the first non-empty record */
+int first_record = 1;
+
+/* The number of the current record */
+uint64_t current_record;
+
+/* The fields of the current record */
+struct record entries;
+
+/* The key fields of the current record as hashed */
+struct outbuf key_bytes;
+
+/* The key fields of the current record followed by the record as printed */
+struct outbuf line;
+
+/* The keys of the input */
+key_set input_keys;
+
+/* Output waiting to be written */
+struct outbuf output;
+
+void write_output(void);
+void print_record(uint64_t count, const char *rec, size_t len);
+void key_set_init(key_set *s, int level);
+void key_set_free(key_set *s);
+size_t key_set_memory(key_set *s);
+void grow_table(key_set *s);
+key *find_key(key_set *s, uint64_t hash, const char *key_bytes, size_t key_len);
+void add_item(key_set *s, const uint64_t *head, const char *data);
+void split_keys(key_set *s);
+void finish_keys(key_set *s, FILE *out);
+void print_item(const uint64_t *head, const char *rec, size_t len);
+void cb1 (void *data, size_t len, void *vp);
+void cb2 (int c, void *vp);
+void usage (int status);
+void cleanup(void);
+
+
+void
+cleanup(void)
+{
+  /* Free memory, temporary files are removed when closed */
+  field_specs_free(&specs);
+  free(key_fields);
+  record_free(&entries);
+  outbuf_free(&key_bytes);
+  outbuf_free(&line);
+  key_set_free(&input_keys);
+  outbuf_free(&output);
+}
+
+void
+usage (int status)
+{
+  if (status != EXIT_SUCCESS)
+    fprintf (stderr, "Try `%s --help for more information.\n", program_name);
+  else {
+    printf("\
+Usage: %s [OPTIONS]... [FILE]\n\
+Print the first of the CSV records with the same values in the specified\n\
+fields, or the first of identical records, in input order\n\
+\n\
+  -c, --count                  print the number of records with the same\n\
+                               values as a field before each record\n\
+  -d, --delimiter=DELIM_CHAR   use DELIM_CHAR instead of comma as delimiter\n\
+  -f, --fields=FIELD_LIST      the field names or numbers to compare, the\n\
+                               whole record is compared if not given\n\
+", program_name);
+    printf("\
+  -h, --header                 print the first record first as it is\n\
+  -q, --quote=QUOTE_CHAR       use QUOTE_CHAR instead of double quote as quote\n\
+                               character\n\
+  -s, --strict                 enforce strict mode, mal-formed CSV files will\n\
+                               cause an error\n\
+");
+    printf("\
+      --duplicates-only        only print records whose values were seen more\n\
+                               than once\n\
+      --memory=SIZE            keep at most SIZE bytes of keys in memory,\n\
+                               using temporary files for the rest\n\
+      --version                display version information and exit\n\
+      --help                   display this help and exit\n\
+");
+  }
+  exit(status);
+}
+
+void
+write_output(void)
+{
+  if (outbuf_flush(&output, stdout) != 0)
+    err("Failed to write output");
+}
+
+void
+print_record(uint64_t count, const char *rec, size_t len)
+{
+  /* Print a record as stored, with -c after the number of records with
+     its key */
+  char buf[32];
+
+  if (print_counts) {
+    sprintf(buf, "%lu", (long unsigned)count);
+    outbuf_csv(&output, buf, strlen(buf), quote);
+    outbuf_putc(&output, delimiter);
+  }
+  outbuf_write(&output, rec, len);
+  if (output.size >= OUTPUT_FLUSH_SIZE)
+    write_output();
+}
+
+void
+key_set_init(key_set *s, int level)
+{
+  size_t i;
+
+  s->keys = NULL;
+  s->key_count = 0;
+  s->key_alloc = 0;
+  s->table = NULL;
+  s->table_size = 0;
+  outbuf_init(&s->data);
+  s->level = level;
+  for (i = 0; i < PARTITIONS; i++)
+    s->parts[i] = NULL;
+}
+
+void
+key_set_free(key_set *s)
+{
+  size_t i;
+
+  free(s->keys);
+  free(s->table);
+  outbuf_free(&s->data);
+  for (i = 0; i < PARTITIONS; i++)
+    if (s->parts[i])
+      fclose(s->parts[i]);
+  key_set_init(s, s->level);
+}
+
+size_t
+key_set_memory(key_set *s)
+{
+  return s->key_alloc * sizeof *s->keys + s->table_size * sizeof *s->table
+         + s->data.alloc;
+}
+
+void
+grow_table(key_set *s)
+{
+  /* Double the number of slots and insert the keys again, the table is
+     indexed by the high bits of the hash, the low bits pick the
+     partitions */
+  size_t i, j, mask;
+
+  free(s->table);
+  s->table_size = s->table_size ? s->table_size * 2 : 1024;
+  s->table = xmalloc(s->table_size * sizeof *s->table);
+  memset(s->table, 0, s->table_size * sizeof *s->table);
+  mask = s->table_size - 1;
+
+  for (i = 0; i < s->key_count; i++) {
+    for (j = (size_t)(s->keys[i].hash >> 32) & mask; s->table[j]; j = (j + 1) & mask)
+      ;
+    s->table[j] = i + 1;
+  }
+}
+
+key *
+find_key(key_set *s, uint64_t hash, const char *key_bytes, size_t key_len)
+{
+  /* Return the key with the given fields, or add it to s with a count of
+     0 and return it.  Keys are only compared when their hashes match. */
+  size_t i, mask;
+  key *k;
+
+  if (s->key_count + 1 > s->table_size / 4 * 3)
+    grow_table(s);
+  mask = s->table_size - 1;
+
+  for (i = (size_t)(hash >> 32) & mask; s->table[i]; i = (i + 1) & mask) {
+    k = &s->keys[s->table[i] - 1];
+    if (k->hash == hash && k->key_len == key_len
+        && !memcmp(s->data.data + k->key, key_bytes, key_len))
+      return k;
+  }
+
+  if (s->key_count == s->key_alloc) {
+    s->key_alloc = s->key_alloc ? s->key_alloc * 2 : 1024;
+    s->keys = xrealloc(s->keys, s->key_alloc * sizeof *s->keys);
+  }
+  s->table[i] = s->key_count + 1;
+  k = &s->keys[s->key_count++];
+  k->hash = hash;
+  k->key = s->data.size;
+  k->key_len = key_len;
+  outbuf_write(&s->data, key_bytes, key_len);
+  k->count = 0;
+  k->printed = 0;
+  k->rec = 0;
+  k->rec_len = 0;
+  return k;
+}
+
+void
+add_item(key_set *s, const uint64_t *head, const char *data)
+{
+  /* Add an item to s, either a record or a key with its count and first
+     record when the input was split, see ITEM_HEAD.  Items are added in
+     input order.  Without -c and --duplicates-only the first record of a
+     key is printed as soon as it is seen, until the input is split. */
+  const char *rec = data + head[2];
+  size_t rec_len = head[5] - head[2];
+  key *k;
+
+  if (s->parts[0]) {
+    item_write(s->parts[partition_index(head[1], s->level)], head, ITEM_HEAD, data);
+    return;
+  }
+
+  k = find_key(s, head[1], data, head[2]);
+  if (k->count) {
+    k->count += head[3];
+    k->printed |= head[4];
+    return;
+  }
+
+  k->seq = head[0];
+  k->count = head[3];
+  k->printed = head[4];
+  if (!k->printed) {
+    if (s->level == 0 && !print_counts && !duplicates_only) {
+      print_record(k->count, rec, rec_len);
+      k->printed = 1;
+    } else {
+      /* The record follows the key, see split_keys() */
+      k->rec = s->data.size;
+      k->rec_len = rec_len;
+      outbuf_write(&s->data, rec, rec_len);
+    }
+  }
+
+  if (partition_needed(key_set_memory(s), memory_limit, s->key_count, s->level))
+    split_keys(s);
+}
+
+void
+split_keys(key_set *s)
+{
+  /* Move the keys of s to PARTITIONS temporary files by their hash, the
+     items added from now on are written to the files as well.  The keys
+     are written in the order first seen so every file is in input order. */
+  uint64_t head[ITEM_HEAD];
+  size_t i;
+  key *k;
+
+  partitions_open(s->parts);
+
+  for (i = 0; i < s->key_count; i++) {
+    k = &s->keys[i];
+    head[0] = k->seq;
+    head[1] = k->hash;
+    head[2] = k->key_len;
+    head[3] = k->count;
+    head[4] = k->printed;
+    head[5] = k->key_len + k->rec_len;
+    item_write(s->parts[partition_index(k->hash, s->level)], head, ITEM_HEAD,
+               s->data.data + k->key);
+  }
+
+  free(s->keys);
+  free(s->table);
+  outbuf_free(&s->data);
+  s->keys = NULL;
+  s->key_count = s->key_alloc = 0;
+  s->table = NULL;
+  s->table_size = 0;
+}
+
+void
+finish_keys(key_set *s, FILE *out)
+{
+  /* Print the first records of the keys of s that were not printed yet in
+     input order, or write them to out as items without their keys.  If s
+     was split each partition is done on its own and the results are
+     merged. */
+  FILE *results[PARTITIONS];
+  uint64_t head[ITEM_HEAD];
+  struct outbuf data;
+  key_set sub;
+  size_t i;
+  key *k;
+
+  if (!s->parts[0]) {
+    for (i = 0; i < s->key_count; i++) {
+      k = &s->keys[i];
+      if (k->printed || (duplicates_only && k->count < 2))
+        continue;
+      if (out) {
+        head[0] = k->seq;
+        head[1] = k->hash;
+        head[2] = 0;
+        head[3] = k->count;
+        head[4] = 0;
+        head[5] = k->rec_len;
+        item_write(out, head, ITEM_HEAD, s->data.data + k->rec);
+      } else
+        print_record(k->count, s->data.data + k->rec, k->rec_len);
+    }
+    return;
+  }
+
+  outbuf_init(&data);
+  partitions_open(results);
+  for (i = 0; i < PARTITIONS; i++) {
+    rewind(s->parts[i]);
+    key_set_init(&sub, s->level + 1);
+    while (item_read(s->parts[i], head, ITEM_HEAD, &data))
+      add_item(&sub, head, data.data);
+    fclose(s->parts[i]);
+    s->parts[i] = NULL;
+    finish_keys(&sub, results[i]);
+    key_set_free(&sub);
+  }
+  outbuf_free(&data);
+
+  /* The results have no keys and are in input order */
+  item_merge(results, PARTITIONS, ITEM_HEAD, 1, out, print_item);
+}
+
+void
+print_item(const uint64_t *head, const char *rec, size_t len)
+{
+  print_record(head[3], rec, len);
+}
+
+void
+cb1 (void *data, size_t len, void *vp)
+{
+  record_add(&entries, data, len);
+}
+
+void
+cb2 (int c, void *vp)
+{
+  uint64_t head[ITEM_HEAD];
+  size_t i;
+
+  if (first_record) {
+    first_record = 0;
+    if (write_header) {
+      if (specs.unresolved) {
+        field_specs_resolve(&specs, &entries);
+        if (specs.unresolved) {
+          fprintf(stderr, "Couldn't find field '%s'\n", field_specs_unresolved_name(&specs));
+          exit(EXIT_FAILURE);
+        }
+        key_fields = field_specs_fields(&specs, &key_field_count);
+      }
+      if (print_counts) {
+        outbuf_csv(&output, "count", 5, quote);
+        outbuf_putc(&output, delimiter);
+      }
+      outbuf_fields(&output, &entries, delimiter, quote);
+      outbuf_putc(&output, '\n');
+      record_reset(&entries);
+      return;
+    }
+  }
+
+  key_bytes.size = 0;
+  if (key_field_count) {
+    for (i = 0; i < key_field_count; i++)
+      outbuf_key_field(&key_bytes, &entries, key_fields[i] - 1);
+  } else {
+    for (i = 0; i < entries.count; i++)
+      outbuf_key_field(&key_bytes, &entries, i);
+  }
+
+  line.size = 0;
+  outbuf_write(&line, key_bytes.data, key_bytes.size);
+  outbuf_fields(&line, &entries, delimiter, quote);
+  outbuf_putc(&line, '\n');
+
+  head[0] = current_record++;
+  head[1] = hash_bytes(key_bytes.data, key_bytes.size, 0);
+  head[2] = key_bytes.size;
+  head[3] = 1;
+  head[4] = 0;
+  head[5] = line.size;
+  add_item(&input_keys, head, line.data);
+
+  record_reset(&entries);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int optc;
+  char *field_list = NULL;
+  struct proj_parser p;
+  size_t bytes_read;
+  char buf[65536];
+
+  program_name = argv[0];
+
+  while ((optc = getopt_long(argc, argv, "cd:f:hq:s", longopts, NULL)) != -1)
+    switch (optc) {
+      case 'c':
+        print_counts = 1;
+        break;
+
+      case 'd':
+        if (strlen(optarg) > 1)
+          err("delimiter must be exactly one byte long");
+        else
+          delimiter = optarg[0];
+        break;
+
+      case 'f':
+        field_list = optarg;
+        break;
+
+      case 'h':
+        write_header = 1;
+        break;
+
+      case 'q':
+        if (strlen(optarg) > 1)
+          err("quote must be exactly one byte long");
+        else
+          quote = optarg[0];
+        break;
+
+      case 's':
+        strict = 1;
+        break;
+
+      case CHAR_MAX + 1:
+        /* --version */
+        print_version(PROGRAM_NAME);
+        break;
+
+      case CHAR_MAX + 2:
+        /* --help */
+        usage(EXIT_SUCCESS);
+        break;
+
+      case CHAR_MAX + 3:
+        /* --duplicates-only */
+        duplicates_only = 1;
+        break;
+
+      case CHAR_MAX + 4:
+        /* --memory */
+        if (Parse_size(optarg, &memory_limit) != 0 || memory_limit < 1)
+          err("Invalid memory size");
+        break;
+
+      default:
+        usage(EXIT_FAILURE);
+    }
+
+  atexit(cleanup);
+
+  if (field_list) {
+    field_specs_parse(&specs, field_list, 0);
+    if (specs.unresolved)
+      write_header = 1;
+    else
+      key_fields = field_specs_fields(&specs, &key_field_count);
+  }
+
+  if (optind < argc) {
+    if (optind + 1 < argc)
+      usage(EXIT_FAILURE);
+    infile = fopen(argv[optind], "rb");
+    if (!infile)
+      err("Could not open file");
+  } else {
+    infile = stdin;
+  }
+
+  key_set_init(&input_keys, 0);
+
+  if (proj_init(&p, strict ? CSV_STRICT|CSV_STRICT_FINI : 0) != 0)
+    err("Failed to initialize csv parser");
+  proj_set_delim(&p, delimiter);
+  proj_set_quote(&p, quote);
+
+  while ((bytes_read = fread(buf, 1, sizeof buf, infile)) > 0) {
+    if (proj_parse(&p, buf, bytes_read, cb1, cb2, NULL) != bytes_read) {
+      fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (proj_fini(&p, cb1, cb2, NULL)) {
+    fprintf(stderr, "Error while parsing file: %s\n", csv_strerror(proj_error(&p)));
+    exit(EXIT_FAILURE);
+  }
+  proj_free(&p);
+
+  finish_keys(&input_keys, NULL);
+  write_output();
+
+  exit(EXIT_SUCCESS);
+}
@@ -1,5 +1,33 @@
 #include "helper.h"
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#  include <emmintrin.h>
+#endif
+
+#ifndef WITHOUT_THREADS
+#  include <pthread.h>
+#endif
+
+/* Bytes read at a time by parallel_chunks() */
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+/* chunk states */
+#define CHUNK_FREE  0
+#define CHUNK_READY 1
+#define CHUNK_BUSY  2
+#define CHUNK_DONE  3
+
+/* proj_parser states, these mirror the libcsv parser states */
+#define ROW_NOT_BEGUN           0
+#define FIELD_NOT_BEGUN         1
+#define FIELD_BEGUN             2
+#define FIELD_MIGHT_HAVE_ENDED  3
+#define SKIP_REST               4  /* Past the last selected field */
+
+static void proj_reserve(struct proj_parser *p, size_t len);
+static void proj_submit_field(struct proj_parser *p, void (*cb1)(void *, size_t, void *), void *data);
+static void proj_submit_row(struct proj_parser *p, int c, void (*cb2)(int, void *), void *data);
+
 void *
 xmalloc(size_t size)
 {
@@ -51,6 +79,29 @@ Strndup(char *s, size_t len)
   return tmp;
 }
 
+int
+Parse_size(char *s, size_t *size)
+{
+  /* Parse a size in bytes with an optional k, M or G suffix into size,
+     returns 0 on success and -1 if s is not a valid size */
+  char *end;
+  unsigned long v;
+  size_t mult = 1;
+
+  if (!isdigit((int)(unsigned char)*s))
+    return -1;
+  v = strtoul(s, &end, 10);
+  switch (*end) {
+    case 'k': case 'K': mult = 1024; end++; break;
+    case 'm': case 'M': mult = 1024 * 1024; end++; break;
+    case 'g': case 'G': mult = 1024 * 1024 * 1024; end++; break;
+  }
+  if (*end || v > (size_t)-1 / mult)
+    return -1;
+  *size = v * mult;
+  return 0;
+}
+
 void
 Strupper(char *s)
 {
@@ -59,3 +110,1697 @@ Strupper(char *s)
     s++;
   }
 }
+
+size_t
+memchr4(const void *s, size_t len, int a, int b, int c, int d)
+{
+  /* Return the offset of the first byte in s equal to one of a, b, c or d,
+     or len if there is no such byte */
+  const unsigned char *us = s;
+  size_t i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+  __m128i va = _mm_set1_epi8((char)a);
+  __m128i vb = _mm_set1_epi8((char)b);
+  __m128i vc = _mm_set1_epi8((char)c);
+  __m128i vd = _mm_set1_epi8((char)d);
+
+  while (i + 16 <= len) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(us + i));
+    int mask = _mm_movemask_epi8(_mm_or_si128(
+                 _mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)),
+                 _mm_or_si128(_mm_cmpeq_epi8(x, vc), _mm_cmpeq_epi8(x, vd))));
+    if (mask)
+      return i + __builtin_ctz(mask);
+    i += 16;
+  }
+#endif
+
+  for (; i < len; i++)
+    if (us[i] == a || us[i] == b || us[i] == c || us[i] == d)
+      return i;
+  return len;
+}
+
+static void
+put_utf8(struct outbuf *out, unsigned long c)
+{
+  /* Append the code point c as UTF-8, room must have been reserved */
+  char *p = out->data + out->size;
+
+  if (c < 0x80) {
+    *p++ = c;
+  } else if (c < 0x800) {
+    *p++ = 0xC0 | c >> 6;
+    *p++ = 0x80 | (c & 0x3F);
+  } else if (c < 0x10000) {
+    *p++ = 0xE0 | c >> 12;
+    *p++ = 0x80 | (c >> 6 & 0x3F);
+    *p++ = 0x80 | (c & 0x3F);
+  } else {
+    *p++ = 0xF0 | c >> 18;
+    *p++ = 0x80 | (c >> 12 & 0x3F);
+    *p++ = 0x80 | (c >> 6 & 0x3F);
+    *p++ = 0x80 | (c & 0x3F);
+  }
+  out->size = p - out->data;
+}
+
+size_t
+latin1_to_utf8(const void *s, size_t len, struct outbuf *out)
+{
+  /* Append the Latin-1 text s to out as UTF-8, returns len */
+  const unsigned char *us = s;
+  size_t i = 0, j;
+
+  outbuf_reserve(out, 2 * len);
+  while (i < len) {
+    /* Copy runs of ASCII as they are */
+    j = i;
+#if defined(__SSE2__) && defined(__GNUC__)
+    while (j + 16 <= len
+           && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(us + j))))
+      j += 16;
+#endif
+    while (j < len && us[j] < 0x80)
+      j++;
+    memcpy(out->data + out->size, us + i, j - i);
+    out->size += j - i;
+    for (i = j; i < len && us[i] >= 0x80; i++)
+      put_utf8(out, us[i]);
+  }
+  return len;
+}
+
+size_t
+utf16_to_utf8(const void *s, size_t len, int big_endian, int eof, struct outbuf *out)
+{
+  /* Append the UTF-16 text s to out as UTF-8 and return the number of bytes
+     converted.  A trailing odd byte or high surrogate is left for the next
+     call unless eof is set, unpaired surrogates become U+FFFD. */
+  const unsigned char *us = s;
+  size_t i = 0;
+  unsigned long c, d;
+  int hi = big_endian ? 0 : 1, lo = big_endian ? 1 : 0;
+
+  /* No code unit takes more than 3 bytes of UTF-8 */
+  outbuf_reserve(out, len / 2 * 3 + 3);
+  while (i + 2 <= len) {
+#if defined(__SSE2__) && defined(__GNUC__)
+    /* Narrow runs of 8 ASCII code units at a time */
+    while (i + 16 <= len) {
+      __m128i x = _mm_loadu_si128((const __m128i *)(us + i));
+      if (big_endian)
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_and_si128(x, _mm_set1_epi16((short)0xFF80)),
+            _mm_setzero_si128())) != 0xFFFF)
+        break;
+      _mm_storel_epi64((__m128i *)(out->data + out->size), _mm_packus_epi16(x, x));
+      out->size += 8;
+      i += 16;
+    }
+    if (i + 2 > len)
+      break;
+#endif
+    c = (unsigned long)us[i + hi] << 8 | us[i + lo];
+    if (c >= 0xD800 && c < 0xDC00) {
+      if (i + 4 > len) {
+        if (!eof)
+          break;
+        c = 0xFFFD;
+      } else {
+        d = (unsigned long)us[i + 2 + hi] << 8 | us[i + 2 + lo];
+        if (d >= 0xDC00 && d < 0xE000) {
+          c = 0x10000 + ((c - 0xD800) << 10) + (d - 0xDC00);
+          i += 2;
+        } else
+          c = 0xFFFD;
+      }
+    } else if (c >= 0xDC00 && c < 0xE000)
+      c = 0xFFFD;
+    put_utf8(out, c);
+    i += 2;
+  }
+
+  if (eof && i < len) {
+    /* A lone trailing byte */
+    put_utf8(out, 0xFFFD);
+    i = len;
+  }
+  return i;
+}
+
+static uint64_t
+load64(const unsigned char *s)
+{
+  /* Little endian load so hashes are the same on every platform */
+  return (uint64_t)s[0] | (uint64_t)s[1] << 8 | (uint64_t)s[2] << 16
+         | (uint64_t)s[3] << 24 | (uint64_t)s[4] << 32 | (uint64_t)s[5] << 40
+         | (uint64_t)s[6] << 48 | (uint64_t)s[7] << 56;
+}
+
+static uint64_t
+mix64(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t
+hash_word(uint64_t h, uint64_t k)
+{
+  /* Add 8 bytes to a hash_bytes() state */
+  k *= 0x87c37b91114253d5ULL;
+  k = (k << 31 | k >> 33) * 0x4cf5ad432745937fULL;
+  h ^= k;
+  return (h << 27 | h >> 37) * 5 + 0x52dce729;
+}
+
+uint64_t
+hash_bytes(const void *s, size_t len, uint64_t seed)
+{
+  /* A fast 64 bit hash of len bytes from s, the result only depends on
+     the bytes and seed so it is stable across runs and platforms */
+  const unsigned char *us = s;
+  uint64_t h = seed ^ ((uint64_t)len * 0x9e3779b97f4a7c15ULL);
+  uint64_t k;
+  size_t i;
+
+  while (len >= 8) {
+    h = hash_word(h, load64(us));
+    us += 8;
+    len -= 8;
+  }
+
+  k = 0;
+  for (i = 0; i < len; i++)
+    k |= (uint64_t)us[i] << (8 * i);
+  h ^= mix64(k + 0x2545f4914f6cdd1dULL);
+
+  return mix64(h);
+}
+
+uint64_t
+hash_parts(const char *const *parts, const size_t *lens, size_t n, uint64_t seed)
+{
+  /* hash_bytes() of the concatenation of n parts without copying them,
+     only the bytes of a word split between parts are gathered */
+  const unsigned char *us;
+  unsigned char word[8];
+  uint64_t h, k;
+  size_t total = 0, fill = 0, len, take, i;
+
+  for (i = 0; i < n; i++)
+    total += lens[i];
+  h = seed ^ ((uint64_t)total * 0x9e3779b97f4a7c15ULL);
+
+  for (i = 0; i < n; i++) {
+    us = (const unsigned char *)parts[i];
+    len = lens[i];
+
+    if (fill) {
+      take = 8 - fill < len ? 8 - fill : len;
+      memcpy(word + fill, us, take);
+      fill += take;
+      us += take;
+      len -= take;
+      if (fill < 8)
+        continue;
+      h = hash_word(h, load64(word));
+      fill = 0;
+    }
+
+    while (len >= 8) {
+      h = hash_word(h, load64(us));
+      us += 8;
+      len -= 8;
+    }
+    if (len)
+      memcpy(word, us, len);
+    fill = len;
+  }
+
+  k = 0;
+  for (i = 0; i < fill; i++)
+    k |= (uint64_t)word[i] << (8 * i);
+  h ^= mix64(k + 0x2545f4914f6cdd1dULL);
+
+  return mix64(h);
+}
+
+void
+record_init(struct record *r)
+{
+  r->data = NULL;
+  r->data_size = r->data_alloc = 0;
+  r->offsets = NULL;
+  r->count = r->offsets_alloc = 0;
+  r->allocs = r->records = 0;
+}
+
+void
+record_free(struct record *r)
+{
+  free(r->data);
+  free(r->offsets);
+  record_init(r);
+}
+
+void
+record_reset(struct record *r)
+{
+  /* Empty the record, the buffers are kept for the next record */
+  r->data_size = 0;
+  r->count = 0;
+  r->records++;
+}
+
+void
+record_add(struct record *r, const void *s, size_t len)
+{
+  /* Append a field to the record.  The buffers grow geometrically and
+     are kept across records so reallocation stops once the largest
+     record has been seen. */
+  size_t size;
+
+  if (r->count + 2 > r->offsets_alloc) {
+    size = r->offsets_alloc ? r->offsets_alloc * 2 : 16;
+    r->offsets = xrealloc(r->offsets, size * sizeof *r->offsets);
+    r->offsets_alloc = size;
+    r->allocs++;
+  }
+
+  if (r->data_size + len > r->data_alloc) {
+    size = r->data_alloc ? r->data_alloc : 256;
+    while (size < r->data_size + len)
+      size *= 2;
+    r->data = xrealloc(r->data, size);
+    r->data_alloc = size;
+    r->allocs++;
+  }
+
+  if (len)
+    memcpy(r->data + r->data_size, s, len);
+  r->offsets[r->count] = r->data_size;
+  r->data_size += len;
+  r->count++;
+  r->offsets[r->count] = r->data_size;
+}
+
+char *
+record_field(struct record *r, size_t i)
+{
+  /* Never returns NULL, even for an empty field */
+  return r->data ? r->data + r->offsets[i] : "";
+}
+
+size_t
+record_field_size(struct record *r, size_t i)
+{
+  return r->offsets[i+1] - r->offsets[i];
+}
+
+void
+outbuf_init(struct outbuf *b)
+{
+  b->data = NULL;
+  b->size = b->alloc = 0;
+}
+
+void
+outbuf_free(struct outbuf *b)
+{
+  free(b->data);
+  outbuf_init(b);
+}
+
+void
+outbuf_reserve(struct outbuf *b, size_t len)
+{
+  /* Make room for len more bytes */
+  size_t size = b->alloc ? b->alloc : 4096;
+  if (b->size + len <= b->alloc)
+    return;
+  while (size < b->size + len)
+    size *= 2;
+  b->data = xrealloc(b->data, size);
+  b->alloc = size;
+}
+
+void
+outbuf_putc(struct outbuf *b, int c)
+{
+  if (b->size == b->alloc)
+    outbuf_reserve(b, 1);
+  b->data[b->size++] = (char)c;
+}
+
+void
+outbuf_write(struct outbuf *b, const void *s, size_t len)
+{
+  if (len == 0)
+    return;
+  outbuf_reserve(b, len);
+  memcpy(b->data + b->size, s, len);
+  b->size += len;
+}
+
+void
+outbuf_csv(struct outbuf *b, const void *s, size_t len, unsigned char quote)
+{
+  /* Append s as a quoted field exactly like csv_fwrite2() would write it */
+  const char *cs = s;
+  const char *q;
+  size_t run;
+
+  outbuf_reserve(b, len + 2);
+  b->data[b->size++] = quote;
+  while (len) {
+    q = memchr(cs, quote, len);
+    run = q ? (size_t)(q - cs) + 1 : len;
+    outbuf_write(b, cs, run);
+    if (q)
+      outbuf_putc(b, quote);
+    cs += run;
+    len -= run;
+  }
+  outbuf_putc(b, quote);
+}
+
+int
+outbuf_flush(struct outbuf *b, FILE *fp)
+{
+  /* Write the buffer to fp and empty it */
+  size_t size = b->size;
+  b->size = 0;
+  if (size && fwrite(b->data, 1, size, fp) != size)
+    return EOF;
+  return 0;
+}
+
+void
+outbuf_put64(struct outbuf *b, uint64_t v)
+{
+  /* Append v as 8 little endian bytes */
+  int i;
+  outbuf_reserve(b, 8);
+  for (i = 0; i < 8; i++)
+    b->data[b->size++] = (char)(v >> (8 * i));
+}
+
+void
+outbuf_pad64(struct outbuf *b)
+{
+  /* Pad with zero bytes to a multiple of 8 bytes */
+  while (b->size % 8)
+    outbuf_putc(b, 0);
+}
+
+void
+outbuf_fields(struct outbuf *b, struct record *r, unsigned char delim, unsigned char quote)
+{
+  /* Print the fields of r to b as CSV, without a newline */
+  size_t i;
+
+  for (i = 0; i < r->count; i++) {
+    if (i)
+      outbuf_putc(b, delim);
+    outbuf_csv(b, record_field(r, i), record_field_size(r, i), quote);
+  }
+}
+
+void
+outbuf_key_field(struct outbuf *b, struct record *r, size_t idx)
+{
+  /* Append field idx of r to a key as its length and bytes, so keys made
+     of the same fields are equal only if each field is.  A field missing
+     from the record is empty. */
+  uint64_t len = idx < r->count ? record_field_size(r, idx) : 0;
+
+  outbuf_write(b, &len, sizeof len);
+  if (len)
+    outbuf_write(b, record_field(r, idx), len);
+}
+
+/*
+   Items are how csvuniq and csvjoin keep records in temporary files once
+   they use more than --memory.  An item is made of n 64 bit values, the
+   last of them the length of the data following them.  Items are split
+   into PARTITIONS files by the hash of their key, the next
+   PARTITION_BITS bits of it at each level, and the results of the
+   partitions are merged back in input order by item_merge().
+*/
+
+void
+item_write(FILE *fp, const uint64_t *head, size_t n, const void *data)
+{
+  /* Write an item made of the n values of head followed by head[n-1]
+     bytes of data */
+  if (fwrite(head, sizeof *head, n, fp) != n
+      || (head[n-1] && fwrite(data, 1, head[n-1], fp) != head[n-1]))
+    err("Failed to write temporary file");
+}
+
+int
+item_read(FILE *fp, uint64_t *head, size_t n, struct outbuf *data)
+{
+  /* Read an item written by item_write() into head and data, return 0 at
+     the end */
+  size_t len;
+
+  if (fread(head, sizeof *head, n, fp) != n) {
+    if (ferror(fp))
+      err("Failed to read temporary file");
+    return 0;
+  }
+  len = head[n-1];
+  data->size = 0;
+  outbuf_reserve(data, len);
+  if (len && fread(data->data, 1, len, fp) != len)
+    err("Failed to read temporary file");
+  data->size = len;
+  return 1;
+}
+
+void
+item_merge(FILE **in, size_t count, size_t n, size_t order, FILE *out,
+           void (*print)(const uint64_t *head, const char *data, size_t len))
+{
+  /* Merge the items of count files, each ordered by the first order values
+     of the items, and close them.  The items are written to out, or
+     passed to print if out is NULL. */
+  uint64_t *head = xmalloc(count * n * sizeof *head);
+  struct outbuf *data = xmalloc(count * sizeof *data);
+  int *live = xmalloc(count * sizeof *live);
+  size_t i, j, best;
+
+  for (i = 0; i < count; i++) {
+    rewind(in[i]);
+    outbuf_init(&data[i]);
+    live[i] = item_read(in[i], &head[i*n], n, &data[i]);
+  }
+
+  for (;;) {
+    best = count;
+    for (i = 0; i < count; i++) {
+      if (!live[i])
+        continue;
+      if (best == count) {
+        best = i;
+        continue;
+      }
+      for (j = 0; j < order && head[i*n + j] == head[best*n + j]; j++)
+        ;
+      if (j < order && head[i*n + j] < head[best*n + j])
+        best = i;
+    }
+    if (best == count)
+      break;
+    if (out)
+      item_write(out, &head[best*n], n, data[best].data);
+    else
+      print(&head[best*n], data[best].data, data[best].size);
+    live[best] = item_read(in[best], &head[best*n], n, &data[best]);
+  }
+
+  for (i = 0; i < count; i++) {
+    outbuf_free(&data[i]);
+    fclose(in[i]);
+  }
+  free(head);
+  free(data);
+  free(live);
+}
+
+void
+partitions_open(FILE **parts)
+{
+  /* Create the PARTITIONS temporary files of one split */
+  size_t i;
+
+  for (i = 0; i < PARTITIONS; i++)
+    if ((parts[i] = tmpfile()) == NULL)
+      err("Failed to create temporary file");
+}
+
+size_t
+partition_index(uint64_t hash, int level)
+{
+  /* The partition of a key with the given hash at a level of splitting,
+     the low bits are used so the high ones are left for hash tables */
+  return (size_t)(hash >> (PARTITION_BITS * level)) & (PARTITIONS - 1);
+}
+
+int
+partition_needed(size_t memory, size_t limit, size_t keys, int level)
+{
+  /* Return 1 if keys using memory bytes at a level should be split into
+     partitions.  Splitting a few keys doesn't help, and the hash bits left
+     for the table run out after 32 / PARTITION_BITS levels. */
+  return memory > limit && keys >= PARTITIONS && level < 32 / PARTITION_BITS;
+}
+
+void
+run_list_init(struct run_list *l, void (*merge)(struct run *in, size_t n, FILE *out))
+{
+  l->runs = NULL;
+  l->count = 0;
+  l->alloc = 0;
+  l->merge = merge;
+}
+
+void
+run_list_free(struct run_list *l)
+{
+  /* Close the runs not merged, temporary files are removed when closed */
+  size_t i;
+
+  for (i = 0; i < l->count; i++)
+    fclose(l->runs[i].fp);
+  free(l->runs);
+  run_list_init(l, l->merge);
+}
+
+FILE *
+run_file(void)
+{
+  /* Create a temporary file for a run */
+  FILE *fp;
+
+  if ((fp = tmpfile()) == NULL)
+    err("Failed to create temporary file");
+  return fp;
+}
+
+static void
+run_list_push(struct run_list *l, FILE *fp, int level)
+{
+  if (fflush(fp) != 0)
+    err("Failed to write temporary file");
+  if (l->count == l->alloc) {
+    l->alloc = l->alloc ? l->alloc * 2 : RUN_FAN_IN;
+    l->runs = xrealloc(l->runs, l->alloc * sizeof *l->runs);
+  }
+  l->runs[l->count].fp = fp;
+  l->runs[l->count].level = level;
+  l->count++;
+}
+
+void
+run_list_add(struct run_list *l, FILE *fp)
+{
+  /* Add a run that was just written.  Once the last RUN_FAN_IN runs have
+     been through the same number of merges they are merged into one, so
+     every byte is copied a few times at most and few runs are open at
+     once.  Only adjacent runs are merged, which keeps the input order. */
+  int level;
+
+  run_list_push(l, fp, 0);
+
+  while (l->count >= RUN_FAN_IN
+         && l->runs[l->count - RUN_FAN_IN].level == l->runs[l->count - 1].level) {
+    fp = run_file();
+    level = l->runs[l->count - 1].level + 1;
+    l->merge(&l->runs[l->count - RUN_FAN_IN], RUN_FAN_IN, fp);
+    l->count -= RUN_FAN_IN;
+    run_list_push(l, fp, level);
+  }
+}
+
+/*
+   Columnar files hold the rows of a CSV file column by column.  All
+   integers are 64 bit little endian and every part starts on an 8 byte
+   boundary so the file can be used directly from memory.
+
+   The file starts with the 8 byte COLUMNAR_MAGIC followed by the version,
+   the number of columns and the number of rows per row group.  Then for
+   each column the length of its name and the name padded to a multiple
+   of 8 bytes.
+
+   The rest of the file consists of row groups, each starting with the
+   number of rows in the group.  For each column follows the size of the
+   heap, the offset of every field in the heap, the length of every field
+   and the heap itself padded to a multiple of 8 bytes.  A field not present
+   in a row has a length of COLUMNAR_ABSENT.
+*/
+
+static int
+read64(FILE *fp, size_t *v)
+{
+  unsigned char buf[8];
+  if (fread(buf, 1, 8, fp) != 8)
+    return -1;
+  *v = load64(buf);
+  return 0;
+}
+
+static int
+read_padded(FILE *fp, struct outbuf *b, size_t len)
+{
+  /* Read len bytes and the padding after them into b */
+  size_t size = (len + 7) / 8 * 8;
+  if (size < len)
+    return -1;
+  b->size = 0;
+  outbuf_reserve(b, size);
+  if (fread(b->data, 1, size, fp) != size)
+    return -1;
+  b->size = size;
+  return 0;
+}
+
+int
+columnar_open(struct columnar_reader *r, FILE *fp, int magic_read)
+{
+  /* Read the file header, if magic_read is set the caller already read
+     and checked the magic number.  Returns 0 on success and -1 if fp is
+     not a columnar file. */
+  char magic[COLUMNAR_MAGIC_SIZE];
+  size_t i, version, len;
+  struct outbuf name;
+
+  r->fp = fp;
+  r->columns = r->rows = 0;
+  r->data = NULL;
+  record_init(&r->names);
+
+  if (!magic_read && (fread(magic, 1, sizeof magic, fp) != sizeof magic
+      || memcmp(magic, COLUMNAR_MAGIC, COLUMNAR_MAGIC_SIZE)))
+    return -1;
+
+  if (read64(fp, &version) || version != COLUMNAR_VERSION
+      || read64(fp, &r->columns) || read64(fp, &r->group_size))
+    return -1;
+
+  outbuf_init(&name);
+  for (i = 0; i < r->columns; i++) {
+    if (read64(fp, &len) || read_padded(fp, &name, len)) {
+      outbuf_free(&name);
+      return -1;
+    }
+    record_add(&r->names, name.data, len);
+  }
+  outbuf_free(&name);
+
+  r->data = xmalloc((r->columns ? r->columns : 1) * sizeof *r->data);
+  for (i = 0; i < r->columns; i++)
+    outbuf_init(&r->data[i]);
+  return 0;
+}
+
+int
+columnar_read_group(struct columnar_reader *r)
+{
+  /* Read the next row group.  Returns 1 if a row group was read, 0 at the
+     end of the file and -1 if the file is malformed. */
+  size_t i, j, rows, heap_size, offset, len;
+  unsigned char *p;
+
+  r->rows = 0;
+  if (read64(r->fp, &rows))
+    return feof(r->fp) && !ferror(r->fp) ? 0 : -1;
+  if (rows > SIZE_MAX / 16)
+    return -1;
+
+  for (i = 0; i < r->columns; i++) {
+    if (read64(r->fp, &heap_size) || heap_size > SIZE_MAX - 16 * rows
+        || read_padded(r->fp, &r->data[i], 16 * rows + heap_size))
+      return -1;
+    /* Every field must lie within the heap */
+    p = (unsigned char *)r->data[i].data;
+    for (j = 0; j < rows; j++) {
+      offset = load64(p + 8 * j);
+      len = load64(p + 8 * (rows + j));
+      if (len != COLUMNAR_ABSENT && (offset > heap_size || len > heap_size - offset))
+        return -1;
+    }
+  }
+
+  r->rows = rows;
+  return 1;
+}
+
+char *
+columnar_field(struct columnar_reader *r, size_t column, size_t row, size_t *len)
+{
+  /* Return field column of row in the current row group and store its
+     length in len, NULL if the row has no such field */
+  unsigned char *p = (unsigned char *)r->data[column].data;
+  uint64_t size = load64(p + 8 * (r->rows + row));
+
+  if (size == COLUMNAR_ABSENT)
+    return NULL;
+  *len = size;
+  return (char *)p + 16 * r->rows + load64(p + 8 * row);
+}
+
+void
+columnar_close(struct columnar_reader *r)
+{
+  /* Free the reader, the file is left open */
+  size_t i;
+  if (r->data)
+    for (i = 0; i < r->columns; i++)
+      outbuf_free(&r->data[i]);
+  free(r->data);
+  r->data = NULL;
+  record_free(&r->names);
+}
+
+#ifndef WITHOUT_THREADS
+struct pipeline {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct chunk *chunks;    /* Ring of chunks being filled or processed */
+  size_t count;            /* The number of chunks */
+  size_t next_process;     /* Sequence number of the next chunk to process */
+  size_t next_ready;       /* Sequence number of the next chunk to fill */
+  int done;                /* Set when there are no more chunks */
+  void (*process)(struct chunk *, void *);
+  void *arg;
+};
+
+static void *
+pipeline_worker(void *vp)
+{
+  struct pipeline *pl = vp;
+  struct chunk *c;
+
+  pthread_mutex_lock(&pl->lock);
+  for (;;) {
+    while (pl->next_process == pl->next_ready && !pl->done)
+      pthread_cond_wait(&pl->cond, &pl->lock);
+    if (pl->next_process == pl->next_ready)
+      break;
+    c = &pl->chunks[pl->next_process++ % pl->count];
+    c->state = CHUNK_BUSY;
+    pthread_mutex_unlock(&pl->lock);
+
+    pl->process(c, pl->arg);
+
+    pthread_mutex_lock(&pl->lock);
+    c->state = CHUNK_DONE;
+    pthread_cond_broadcast(&pl->cond);
+  }
+  pthread_mutex_unlock(&pl->lock);
+  return NULL;
+}
+
+static int
+fill_chunk(struct chunk *c, FILE *fp, struct proj_parser *scanner, struct outbuf *carry)
+{
+  /* Fill c with the bytes left over from the previous chunk plus new
+     input up to the end of the last complete record, the bytes after it
+     are left in carry, a chunk never ends between a carriage return and a
+     newline.  Returns 1 when the input is exhausted. */
+  size_t bytes_read, start, end;
+  int ch;
+
+  c->size = 0;
+  c->last = 0;
+  c->status = 0;
+  c->out.size = 0;
+
+  if (c->alloc < carry->size + CHUNK_SIZE) {
+    c->alloc = carry->size + CHUNK_SIZE;
+    c->data = xrealloc(c->data, c->alloc);
+  }
+  if (carry->size)
+    memcpy(c->data, carry->data, carry->size);
+  c->size = carry->size;
+  carry->size = 0;
+
+  for (;;) {
+    if (c->alloc < c->size + CHUNK_SIZE) {
+      c->alloc = 2 * c->alloc;
+      c->data = xrealloc(c->data, c->alloc);
+    }
+    start = c->size;
+    bytes_read = fread(c->data + start, 1, CHUNK_SIZE, fp);
+    c->size += bytes_read;
+    if (bytes_read == 0) {
+      /* The rest of the input is the last chunk */
+      c->last = 1;
+      return 1;
+    }
+
+    /* The scanner only finds record boundaries, it sees every byte once */
+    proj_parse(scanner, c->data + start, bytes_read, NULL, NULL, NULL);
+    if (scanner->row_pos) {
+      end = start + scanner->row_pos;
+      /* A carriage return is never split from the newline after it */
+      if (c->data[end - 1] == '\r') {
+        if (end == c->size && (ch = getc(fp)) != EOF) {
+          if (c->size == c->alloc)
+            c->data = xrealloc(c->data, ++c->alloc);
+          c->data[c->size++] = ch;
+          proj_parse(scanner, c->data + end, 1, NULL, NULL, NULL);
+        }
+        if (end < c->size && c->data[end] == '\n')
+          end++;
+      }
+      outbuf_write(carry, c->data + end, c->size - end);
+      c->size = end;
+      return 0;
+    }
+  }
+}
+
+int
+parallel_chunks(FILE *fp, int threads, unsigned char delim, unsigned char quote,
+                void (*process)(struct chunk *, void *),
+                int (*finish)(struct chunk *, void *),
+                void *arg, int *serial)
+{
+  /* Split the input from fp into chunks ending on record boundaries and
+     call process on each chunk using threads worker threads, then call
+     finish on each processed chunk in input order from the calling thread.
+     While *serial is set chunks are processed by the calling thread one at
+     a time, this allows the first record to be handled before any workers
+     start.  Processing stops if finish returns non-zero, the return value
+     is that of the last call to finish. */
+  static const unsigned char no_columns[1];
+  struct pipeline pl;
+  struct proj_parser scanner;
+  struct outbuf carry;
+  struct chunk *c;
+  pthread_t *workers;
+  size_t next_finish = 0, i;
+  int eof = 0, stop = 0, rv = 0;
+
+  pthread_mutex_init(&pl.lock, NULL);
+  pthread_cond_init(&pl.cond, NULL);
+  pl.count = 2 * threads;
+  pl.chunks = xmalloc(pl.count * sizeof *pl.chunks);
+  for (i = 0; i < pl.count; i++) {
+    pl.chunks[i].data = NULL;
+    pl.chunks[i].alloc = 0;
+    pl.chunks[i].state = CHUNK_FREE;
+    outbuf_init(&pl.chunks[i].out);
+  }
+  pl.next_process = pl.next_ready = 0;
+  pl.done = 0;
+  pl.process = process;
+  pl.arg = arg;
+
+  /* Record boundaries must be found the way the real parsers see them */
+  proj_init(&scanner, 0);
+  proj_set_delim(&scanner, delim);
+  proj_set_quote(&scanner, quote);
+  proj_set_columns(&scanner, no_columns, 0);
+  outbuf_init(&carry);
+
+  workers = xmalloc(threads * sizeof *workers);
+  for (i = 0; i < (size_t)threads; i++)
+    if (pthread_create(&workers[i], NULL, pipeline_worker, &pl) != 0)
+      err("Failed to create thread");
+
+  for (;;) {
+    if (!eof && !stop && pl.next_ready - next_finish < pl.count) {
+      c = &pl.chunks[pl.next_ready % pl.count];
+      eof = fill_chunk(c, fp, &scanner, &carry);
+
+      if (*serial && next_finish == pl.next_ready) {
+        /* Nothing is in flight, process it right here */
+        process(c, arg);
+        pthread_mutex_lock(&pl.lock);
+        pl.next_ready++;
+        pl.next_process++;
+        pthread_mutex_unlock(&pl.lock);
+        next_finish++;
+        if ((rv = finish(c, arg)) != 0)
+          stop = 1;
+        continue;
+      }
+
+      pthread_mutex_lock(&pl.lock);
+      c->state = CHUNK_READY;
+      pl.next_ready++;
+      pthread_cond_broadcast(&pl.cond);
+      pthread_mutex_unlock(&pl.lock);
+      continue;
+    }
+
+    if (next_finish == pl.next_ready)
+      break;
+
+    /* Wait for the oldest chunk and finish it */
+    c = &pl.chunks[next_finish % pl.count];
+    pthread_mutex_lock(&pl.lock);
+    while (c->state != CHUNK_DONE)
+      pthread_cond_wait(&pl.cond, &pl.lock);
+    pthread_mutex_unlock(&pl.lock);
+
+    if (!stop && (rv = finish(c, arg)) != 0)
+      stop = 1;
+    c->state = CHUNK_FREE;
+    next_finish++;
+  }
+
+  pthread_mutex_lock(&pl.lock);
+  pl.done = 1;
+  pthread_cond_broadcast(&pl.cond);
+  pthread_mutex_unlock(&pl.lock);
+  for (i = 0; i < (size_t)threads; i++)
+    pthread_join(workers[i], NULL);
+
+  for (i = 0; i < pl.count; i++) {
+    free(pl.chunks[i].data);
+    outbuf_free(&pl.chunks[i].out);
+  }
+  free(pl.chunks);
+  free(workers);
+  outbuf_free(&carry);
+  proj_free(&scanner);
+  pthread_cond_destroy(&pl.cond);
+  pthread_mutex_destroy(&pl.lock);
+
+  return rv;
+}
+#endif
+
+void
+name_table_init(struct name_table *t)
+{
+  t->slots = NULL;
+  t->size = 0;
+  t->count = 0;
+}
+
+void
+name_table_free(struct name_table *t)
+{
+  size_t i;
+  for (i = 0; i < t->size; i++) {
+    free(t->slots[i].name);
+    free(t->slots[i].values);
+  }
+  free(t->slots);
+  name_table_init(t);
+}
+
+static struct name_entry *
+name_table_slot(struct name_table *t, const char *name, size_t len, uint64_t hash)
+{
+  /* Return the slot holding name or the empty slot where it belongs */
+  size_t i = (size_t)hash & (t->size - 1);
+  while (t->slots[i].name) {
+    if (t->slots[i].hash == hash && t->slots[i].len == len
+        && !memcmp(t->slots[i].name, name, len))
+      break;
+    i = (i + 1) & (t->size - 1);
+  }
+  return &t->slots[i];
+}
+
+void
+name_table_add(struct name_table *t, const char *name, size_t len, size_t value)
+{
+  /* Add value to the list of values for name */
+  struct name_entry *e, *old = t->slots;
+  uint64_t hash = hash_bytes(name, len, 0);
+  size_t i, old_size = t->size;
+
+  /* Keep the table at most half full */
+  if (2 * (t->count + 1) > t->size) {
+    t->size = t->size ? t->size * 2 : 16;
+    t->slots = xmalloc(t->size * sizeof *t->slots);
+    for (i = 0; i < t->size; i++) {
+      t->slots[i].name = NULL;
+      t->slots[i].values = NULL;
+    }
+    for (i = 0; i < old_size; i++)
+      if (old[i].name)
+        *name_table_slot(t, old[i].name, old[i].len, old[i].hash) = old[i];
+    free(old);
+  }
+
+  e = name_table_slot(t, name, len, hash);
+  if (!e->name) {
+    e->name = Strndup((char *)name, len);
+    e->len = len;
+    e->hash = hash;
+    e->values = NULL;
+    e->count = 0;
+    t->count++;
+  }
+  e->values = xrealloc(e->values, (e->count + 1) * sizeof *e->values);
+  e->values[e->count++] = value;
+}
+
+size_t *
+name_table_find(struct name_table *t, const char *name, size_t len, size_t *count)
+{
+  /* Return the values for name and set count to their number,
+     returns NULL if name is not in the table */
+  struct name_entry *e;
+
+  *count = 0;
+  if (t->count == 0)
+    return NULL;
+
+  e = name_table_slot(t, name, len, hash_bytes(name, len, 0));
+  if (!e->name)
+    return NULL;
+  *count = e->count;
+  return e->values;
+}
+
+void
+header_cache_init(struct header_cache *c, size_t width)
+{
+  c->entries = NULL;
+  c->count = 0;
+  c->width = width;
+}
+
+void
+header_cache_free(struct header_cache *c)
+{
+  size_t i;
+  for (i = 0; i < c->count; i++) {
+    record_free(&c->entries[i].header);
+    free(c->entries[i].positions);
+  }
+  free(c->entries);
+  c->entries = NULL;
+  c->count = 0;
+}
+
+static uint64_t
+header_fingerprint(struct record *header)
+{
+  /* The offsets are included so that field boundaries matter */
+  if (!header->offsets)
+    return 0;
+  return hash_bytes(header->data ? header->data : "", header->data_size,
+                    hash_bytes(header->offsets, (header->count + 1) * sizeof *header->offsets, 0));
+}
+
+int
+header_cache_find(struct header_cache *c, struct record *header, size_t *positions)
+{
+  /* If an identical header was added before copy the positions resolved
+     from it to positions and return 1, otherwise return 0 */
+  uint64_t fingerprint = header_fingerprint(header);
+  struct header_cache_entry *e;
+  size_t i;
+
+  for (i = 0; i < c->count; i++) {
+    e = &c->entries[i];
+    if (e->fingerprint == fingerprint
+        && e->header.count == header->count
+        && e->header.data_size == header->data_size
+        && !memcmp(e->header.offsets, header->offsets, (header->count + 1) * sizeof *header->offsets)
+        && (header->data_size == 0 || !memcmp(e->header.data, header->data, header->data_size))) {
+      memcpy(positions, e->positions, c->width * sizeof *positions);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void
+header_cache_add(struct header_cache *c, struct record *header, const size_t *positions)
+{
+  struct header_cache_entry *e;
+  size_t i;
+
+  c->entries = xrealloc(c->entries, (c->count + 1) * sizeof *c->entries);
+  e = &c->entries[c->count++];
+  e->fingerprint = header_fingerprint(header);
+  record_init(&e->header);
+  for (i = 0; i < header->count; i++)
+    record_add(&e->header, record_field(header, i), record_field_size(header, i));
+  e->positions = xmalloc((c->width ? c->width : 1) * sizeof *positions);
+  memcpy(e->positions, positions, c->width * sizeof *positions);
+}
+
+static int
+field_spec_not_a_space(unsigned char c)
+{
+  /* Preserve spaces when parsing field specs */
+  return 0;
+}
+
+static size_t
+field_spec_value(struct field_specs *f, char *s)
+{
+  /* Return the field number s, or 0 for a name to be resolved later */
+  size_t value;
+
+  if (!Is_numeric(s)) {
+    f->unresolved++;
+    return 0;
+  }
+  value = strtoul(s, NULL, 10);
+  if (value == 0)
+    err("0 is not a valid field index");
+  return value;
+}
+
+static void
+field_spec_cb1(void *s, size_t len, void *data)
+{
+  /* Add the spec of one field of the field list, either a field or a
+     range of fields like 2-4 */
+  struct field_specs *f = data;
+  struct field_range *spec;
+  char *field = Strndup(s, len);
+  char *dash = strchr(field, '-');
+  char *left, *right;
+
+  if (dash) {
+    if (dash == field || strchr(dash + 1, '-'))
+      err("Invalid field spec");
+    left = Strndup(field, dash - field);
+    right = Strdup(dash + 1);
+  } else {
+    left = Strdup(field);
+    right = Strdup(field);
+  }
+  free(field);
+
+  f->specs = xrealloc(f->specs, (f->count + 1) * sizeof *f->specs);
+  spec = &f->specs[f->count++];
+  spec->start_value = field_spec_value(f, left);
+  spec->stop_value = field_spec_value(f, right);
+  spec->start_name = spec->start_value ? NULL : left;
+  spec->stop_name = spec->stop_value ? NULL : right;
+  if (spec->start_value)
+    free(left);
+  if (spec->stop_value)
+    free(right);
+}
+
+static void
+field_spec_cb2(int c, void *data)
+{
+  /* Field spec should not contain newlines */
+  if (c >= 0)
+    err("Invalid field spec");
+}
+
+void
+field_specs_init(struct field_specs *f)
+{
+  f->specs = NULL;
+  f->count = 0;
+  f->unresolved = 0;
+  f->indexed = 0;
+  name_table_init(&f->names);
+  header_cache_init(&f->headers, 0);
+  f->positions = NULL;
+}
+
+void
+field_specs_free(struct field_specs *f)
+{
+  size_t i;
+  for (i = 0; i < f->count; i++) {
+    free(f->specs[i].start_name);
+    free(f->specs[i].stop_name);
+  }
+  free(f->specs);
+  name_table_free(&f->names);
+  header_cache_free(&f->headers);
+  free(f->positions);
+  field_specs_init(f);
+}
+
+void
+field_specs_parse(struct field_specs *f, char *list, int trim)
+{
+  /* Add the specs of a comma separated field list to f, fields may be
+     quoted as in CSV to include commas in their names.  Spaces around
+     the fields are dropped if trim is set and kept otherwise. */
+  struct csv_parser p;
+  size_t len = strlen(list);
+
+  if (csv_init(&p, CSV_STRICT|CSV_STRICT_FINI))
+    err("Failed to initialize csv parser");
+
+  if (!trim)
+    csv_set_space_func(&p, field_spec_not_a_space);
+
+  if (csv_parse(&p, list, len, field_spec_cb1, field_spec_cb2, f) != len)
+    err("Invalid field spec");
+
+  if (csv_fini(&p, field_spec_cb1, field_spec_cb2, f))
+    err("Invalid field spec");
+
+  csv_free(&p);
+
+  if (f->count == 0)
+    err("Field list cannot be empty");
+}
+
+static void
+field_specs_index(struct field_specs *f)
+{
+  /* Build the table used to look up the field names in a header */
+  size_t i;
+
+  for (i = 0; i < f->count; i++) {
+    if (f->specs[i].start_name != NULL)
+      name_table_add(&f->names, f->specs[i].start_name,
+                     strlen(f->specs[i].start_name), 2*i);
+    if (f->specs[i].stop_name != NULL)
+      name_table_add(&f->names, f->specs[i].stop_name,
+                     strlen(f->specs[i].stop_name), 2*i+1);
+  }
+
+  header_cache_init(&f->headers, 2*f->count);
+  f->positions = xmalloc((f->count ? 2*f->count : 1) * sizeof *f->positions);
+  f->indexed = 1;
+}
+
+void
+field_specs_resolve(struct field_specs *f, struct record *header)
+{
+  /* Resolve field names using the header record, the first field seen
+     with a given name is the one used.  Each header field is looked up
+     once, and the positions are kept to be reused for the same header. */
+  size_t i, j, count, *values;
+  struct field_range *spec;
+
+  if (!f->indexed)
+    field_specs_index(f);
+
+  if (header_cache_find(&f->headers, header, f->positions)) {
+    /* Same header as before, reuse its positions */
+    f->unresolved = 0;
+    for (i = 0; i < f->count; i++) {
+      f->specs[i].start_value = f->positions[2*i];
+      f->specs[i].stop_value = f->positions[2*i+1];
+      if (f->specs[i].start_name != NULL && f->specs[i].start_value == 0)
+        f->unresolved++;
+      if (f->specs[i].stop_name != NULL && f->specs[i].stop_value == 0)
+        f->unresolved++;
+    }
+    return;
+  }
+
+  for (i = 0; i < header->count && f->unresolved; i++) {
+    values = name_table_find(&f->names, record_field(header, i),
+                             record_field_size(header, i), &count);
+    for (j = 0; j < count; j++) {
+      spec = &f->specs[values[j] / 2];
+      if (values[j] % 2 == 0 && spec->start_value == 0) {
+        spec->start_value = i+1;
+        f->unresolved--;
+      } else if (values[j] % 2 == 1 && spec->stop_value == 0) {
+        spec->stop_value = i+1;
+        f->unresolved--;
+      }
+    }
+  }
+
+  for (i = 0; i < f->count; i++) {
+    f->positions[2*i] = f->specs[i].start_value;
+    f->positions[2*i+1] = f->specs[i].stop_value;
+  }
+  header_cache_add(&f->headers, header, f->positions);
+}
+
+void
+field_specs_unresolve(struct field_specs *f)
+{
+  /* Forget the numbers resolved for field names, to resolve them again
+     from another header */
+  size_t i;
+
+  for (i = 0; i < f->count; i++) {
+    if (f->specs[i].start_name != NULL) {
+      f->specs[i].start_value = 0;
+      f->unresolved++;
+    }
+    if (f->specs[i].stop_name != NULL) {
+      f->specs[i].stop_value = 0;
+      f->unresolved++;
+    }
+  }
+}
+
+char *
+field_specs_unresolved_name(struct field_specs *f)
+{
+  /* Return the first field name that was not resolved, "" if none */
+  size_t i;
+
+  for (i = 0; i < f->count; i++) {
+    if (f->specs[i].start_name != NULL && f->specs[i].start_value == 0)
+      return f->specs[i].start_name;
+    if (f->specs[i].stop_name != NULL && f->specs[i].stop_value == 0)
+      return f->specs[i].stop_name;
+  }
+  return "";
+}
+
+size_t *
+field_specs_fields(struct field_specs *f, size_t *count)
+{
+  /* Return the numbers of the fields of the resolved specs in order and
+     set count to their number, a range like 2-4 or 4-2 stands for each
+     field in it in that order.  The array is to be freed by the caller. */
+  size_t i, j, start, stop, n = 0;
+  size_t *fields = NULL;
+
+  for (i = 0; i < f->count; i++) {
+    start = f->specs[i].start_value;
+    stop = f->specs[i].stop_value;
+    for (j = start; ; j += start <= stop ? 1 : -1) {
+      fields = xrealloc(fields, (n + 1) * sizeof *fields);
+      fields[n++] = j;
+      if (j == stop)
+        break;
+    }
+  }
+  *count = n;
+  return fields;
+}
+
+int
+proj_init(struct proj_parser *p, unsigned char options)
+{
+  p->pstate = ROW_NOT_BEGUN;
+  p->quoted = 0;
+  p->spaces = 0;
+  p->status = 0;
+  p->options = options;
+  p->delim = CSV_COMMA;
+  p->quote = CSV_QUOTE;
+  p->entry_buf = NULL;
+  p->entry_pos = 0;
+  p->entry_size = 0;
+  p->field = 0;
+  p->wanted = 1;
+  p->at_field_start = 0;
+  p->columns = NULL;
+  p->columns_size = 0;
+  p->row_pos = 0;
+  return 0;
+}
+
+void
+proj_free(struct proj_parser *p)
+{
+  free(p->entry_buf);
+  p->entry_buf = NULL;
+  p->entry_size = 0;
+}
+
+void
+proj_set_delim(struct proj_parser *p, unsigned char c)
+{
+  p->delim = c;
+}
+
+void
+proj_set_quote(struct proj_parser *p, unsigned char c)
+{
+  p->quote = c;
+}
+
+void
+proj_set_columns(struct proj_parser *p, const unsigned char *columns, size_t size)
+{
+  /* Select the fields passed to cb1.  If columns is NULL every field is
+     passed as with csv_parse(), otherwise field i (starting at 0) is
+     unescaped and passed to cb1 only if i < size and columns[i] is set.
+     Unselected fields before the last selected field are passed to cb1
+     as a NULL pointer so the callback can keep track of field positions,
+     fields after it are skipped without calling cb1.  The columns array
+     must remain valid while the parser uses it. */
+  p->columns = columns;
+  p->columns_size = size;
+  p->wanted = !columns || (p->field < size && columns[p->field]);
+}
+
+int
+proj_error(struct proj_parser *p)
+{
+  return p->status;
+}
+
+static void
+proj_reserve(struct proj_parser *p, size_t len)
+{
+  /* Make room for len more bytes in the entry buffer */
+  size_t size = p->entry_size ? p->entry_size : 128;
+  if (p->entry_pos + len <= p->entry_size)
+    return;
+  while (size < p->entry_pos + len)
+    size *= 2;
+  p->entry_buf = xrealloc(p->entry_buf, size);
+  p->entry_size = size;
+}
+
+static void
+proj_submit_field(struct proj_parser *p, void (*cb1)(void *, size_t, void *), void *data)
+{
+  if (p->wanted) {
+    /* Trailing spaces are not part of an unquoted field */
+    if (!p->quoted)
+      p->entry_pos -= p->spaces;
+    /* A NULL pointer is reserved for unselected fields */
+    if (!p->entry_buf)
+      proj_reserve(p, 1);
+    if (cb1)
+      cb1(p->entry_buf, p->entry_pos, data);
+  } else if (p->field < p->columns_size && cb1) {
+    cb1(NULL, 0, data);
+  }
+
+  p->field++;
+  p->wanted = !p->columns || (p->field < p->columns_size && p->columns[p->field]);
+  p->pstate = FIELD_NOT_BEGUN;
+  p->entry_pos = p->quoted = p->spaces = 0;
+
+  if (p->columns && p->field >= p->columns_size) {
+    p->pstate = SKIP_REST;
+    p->at_field_start = 1;
+  }
+}
+
+static void
+proj_submit_row(struct proj_parser *p, int c, void (*cb2)(int, void *), void *data)
+{
+  if (cb2)
+    cb2(c, data);
+
+  /* cb2 may have changed the selected columns */
+  p->field = 0;
+  p->wanted = !p->columns || (p->columns_size && p->columns[0]);
+  p->pstate = ROW_NOT_BEGUN;
+  p->entry_pos = p->quoted = p->spaces = 0;
+}
+
+size_t
+proj_parse(struct proj_parser *p, const void *s, size_t len,
+           void (*cb1)(void *, size_t, void *),
+           void (*cb2)(int, void *), void *data)
+{
+  /* Parse len bytes from s, calling cb1 for each field and cb2 at the end
+     of each record like csv_parse().  Runs of ordinary bytes are located
+     with memchr4() and copied in bulk, and the bytes of unselected fields
+     are never copied at all. */
+  const unsigned char *us = s;
+  unsigned char c;
+  size_t pos = 0, run, i;
+
+  p->row_pos = 0;
+  while (pos < len) {
+    switch (p->pstate) {
+      case ROW_NOT_BEGUN:
+      case FIELD_NOT_BEGUN:
+        c = us[pos++];
+        if ((c == CSV_SPACE || c == CSV_TAB) && c != p->delim)
+          continue;
+        if (c == CSV_CR || c == CSV_LF) {
+          /* Empty records are ignored */
+          if (p->pstate == FIELD_NOT_BEGUN) {
+            proj_submit_field(p, cb1, data);
+            p->row_pos = pos;
+            proj_submit_row(p, c, cb2, data);
+          }
+        } else if (c == p->delim) {
+          proj_submit_field(p, cb1, data);
+        } else if (c == p->quote) {
+          p->pstate = FIELD_BEGUN;
+          p->quoted = 1;
+        } else {
+          p->pstate = FIELD_BEGUN;
+          p->quoted = 0;
+          if (p->wanted) {
+            proj_reserve(p, 1);
+            p->entry_buf[p->entry_pos++] = c;
+          }
+        }
+        break;
+
+      case FIELD_BEGUN:
+        if (p->quoted) {
+          /* Everything up to the next quote belongs to the field */
+          const unsigned char *q = memchr(us + pos, p->quote, len - pos);
+          run = q ? (size_t)(q - (us + pos)) : len - pos;
+          if (p->wanted) {
+            proj_reserve(p, run + 1);
+            memcpy(p->entry_buf + p->entry_pos, us + pos, run);
+            p->entry_pos += run;
+          }
+          pos += run;
+          if (pos == len)
+            break;
+          pos++;
+          /* The quote is removed again if it turns out to end the field */
+          if (p->wanted)
+            p->entry_buf[p->entry_pos++] = p->quote;
+          p->pstate = FIELD_MIGHT_HAVE_ENDED;
+          break;
+        }
+
+        run = memchr4(us + pos, len - pos, p->delim, p->quote, CSV_CR, CSV_LF);
+        if (p->wanted && run) {
+          proj_reserve(p, run + 1);
+          memcpy(p->entry_buf + p->entry_pos, us + pos, run);
+          p->entry_pos += run;
+          /* Keep track of trailing spaces so they can be trimmed */
+          for (i = run; i > 0 && (us[pos+i-1] == CSV_SPACE || us[pos+i-1] == CSV_TAB); i--)
+            ;
+          p->spaces = (i == 0) ? p->spaces + run : run - i;
+        }
+        pos += run;
+        if (pos == len)
+          break;
+
+        c = us[pos++];
+        if (c == p->quote) {
+          if (p->options & CSV_STRICT) {
+            p->status = CSV_EPARSE;
+            return pos - 1;
+          }
+          if (p->wanted) {
+            proj_reserve(p, 1);
+            p->entry_buf[p->entry_pos++] = c;
+          }
+          p->spaces = 0;
+        } else if (c == p->delim) {
+          proj_submit_field(p, cb1, data);
+        } else {
+          proj_submit_field(p, cb1, data);
+          p->row_pos = pos;
+          proj_submit_row(p, c, cb2, data);
+        }
+        break;
+
+      case FIELD_MIGHT_HAVE_ENDED:
+        /* Only reached after a quote in a quoted field */
+        c = us[pos++];
+        if (c == p->delim || c == CSV_CR || c == CSV_LF) {
+          if (p->wanted)
+            p->entry_pos -= p->spaces + 1;
+          proj_submit_field(p, cb1, data);
+          if (c != p->delim) {
+            p->row_pos = pos;
+            proj_submit_row(p, c, cb2, data);
+          }
+        } else if (c == CSV_SPACE || c == CSV_TAB) {
+          if (p->wanted) {
+            proj_reserve(p, 1);
+            p->entry_buf[p->entry_pos++] = c;
+          }
+          p->spaces++;
+        } else if (c == p->quote) {
+          if (p->spaces) {
+            /* Unescaped quote after spaces */
+            if (p->options & CSV_STRICT) {
+              p->status = CSV_EPARSE;
+              return pos - 1;
+            }
+            p->spaces = 0;
+            if (p->wanted) {
+              proj_reserve(p, 1);
+              p->entry_buf[p->entry_pos++] = c;
+            }
+          } else {
+            /* Two quotes in a row, the first one is already in the buffer */
+            p->pstate = FIELD_BEGUN;
+          }
+        } else {
+          /* Anything else after a quote */
+          if (p->options & CSV_STRICT) {
+            p->status = CSV_EPARSE;
+            return pos - 1;
+          }
+          p->pstate = FIELD_BEGUN;
+          p->spaces = 0;
+          if (p->wanted) {
+            proj_reserve(p, 1);
+            p->entry_buf[p->entry_pos++] = c;
+          }
+        }
+        break;
+
+      case SKIP_REST:
+        /* Nothing else in this record is needed, only quoted fields can
+           hide the end of the record so delimiters are not examined */
+        run = memchr4(us + pos, len - pos, p->quote, CSV_CR, CSV_LF, CSV_LF);
+        for (i = run; i > 0; i--) {
+          c = us[pos+i-1];
+          if ((c != CSV_SPACE && c != CSV_TAB) || c == p->delim) {
+            p->at_field_start = (c == p->delim);
+            break;
+          }
+        }
+        pos += run;
+        if (pos == len)
+          break;
+
+        c = us[pos++];
+        if (c == p->quote) {
+          if (p->at_field_start) {
+            p->pstate = FIELD_BEGUN;
+            p->quoted = 1;
+          } else if (p->options & CSV_STRICT) {
+            p->status = CSV_EPARSE;
+            return pos - 1;
+          }
+        } else {
+          p->row_pos = pos;
+          proj_submit_row(p, c, cb2, data);
+        }
+        break;
+    }
+  }
+
+  return pos;
+}
+
+int
+proj_fini(struct proj_parser *p, void (*cb1)(void *, size_t, void *),
+          void (*cb2)(int, void *), void *data)
+{
+  /* Finish the last record if it wasn't terminated by a newline */
+  if (p->pstate == FIELD_BEGUN && p->quoted && (p->options & CSV_STRICT)
+      && (p->options & CSV_STRICT_FINI)) {
+    p->status = CSV_EPARSE;
+    return -1;
+  }
+
+  if (p->pstate == FIELD_MIGHT_HAVE_ENDED && p->wanted)
+    p->entry_pos -= p->spaces + 1;
+
+  if (p->pstate != ROW_NOT_BEGUN) {
+    proj_submit_field(p, cb1, data);
+    proj_submit_row(p, -1, cb2, data);
+  }
+
+  p->status = 0;
+  return 0;
+}